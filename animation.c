@@ -0,0 +1,76 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "animation.h"
+
+void transition_set(struct transition *transition, uint32_t from, uint32_t to,
+		const struct timespec *now, int duration_ms) {
+	if (transition->to == to) {
+		return;
+	}
+	transition->to = to;
+	if (duration_ms <= 0 || from == to) {
+		transition->from = to;
+		transition->start = (struct timespec){0};
+		return;
+	}
+	transition->from = from;
+	transition->start = *now;
+}
+
+uint8_t transition_progress(struct transition *transition,
+		const struct timespec *now, int duration_ms) {
+	if (transition->start.tv_sec == 0 && transition->start.tv_nsec == 0) {
+		return TRANSITION_DONE;
+	}
+	double elapsed_ms = (now->tv_sec - transition->start.tv_sec) * 1000.0 +
+		(now->tv_nsec - transition->start.tv_nsec) / 1000000.0;
+	double t = duration_ms > 0 ? elapsed_ms / duration_ms : 1;
+	if (t >= 1) {
+		transition->from = transition->to;
+		transition->start = (struct timespec){0};
+		return TRANSITION_DONE;
+	}
+	if (t < 0) {
+		t = 0;
+	}
+
+	// Ease out, fast at first so the change is seen right away
+	double u = 1 - t;
+	int progress = (1 - u * u * u) * TRANSITION_DONE;
+	// Only a done transition is at TRANSITION_DONE, so that the last
+	// frame is always drawn
+	return progress < TRANSITION_DONE ? progress : TRANSITION_DONE - 1;
+}
+
+uint32_t blend_colors(uint32_t from, uint32_t to, uint8_t progress) {
+	// Fading in or out keeps the color, only the alpha changes
+	if (from == 0) {
+		from = to & 0xFFFFFF00;
+	} else if (to == 0) {
+		to = from & 0xFFFFFF00;
+	}
+	uint32_t color = 0;
+	for (int shift = 0; shift < 32; shift += 8) {
+		int a = (from >> shift) & 0xFF;
+		int b = (to >> shift) & 0xFF;
+		uint32_t channel = (a * (TRANSITION_DONE - progress) + b * progress +
+			TRANSITION_DONE / 2) / TRANSITION_DONE;
+		color |= channel << shift;
+	}
+	return color;
+}
+
+void animation_finish(struct indicator_animation *animation) {
+	struct transition *transitions[] = {
+		&animation->opacity,
+		&animation->border,
+		&animation->highlight_color,
+		&animation->highlight_angle,
+	};
+	for (size_t i = 0; i < sizeof(transitions) / sizeof(transitions[0]); ++i) {
+		transitions[i]->from = transitions[i]->to;
+		transitions[i]->start = (struct timespec){0};
+	}
+}
@@ -0,0 +1,264 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <wayland-client.h>
+#include "background-cache.h"
+#include "log.h"
+#include "pool-buffer.h"
+
+/*
+ * Each cache file holds one rendered background: a header followed by the
+ * key it was stored under, padded to CACHE_DATA_OFFSET, followed by the raw
+ * ARGB8888 pixels. The file can be handed to wl_shm_create_pool as is.
+ *
+ * Files are only ever replaced by renaming a new file over them, never
+ * truncated, so a compositor that still maps an old one is not affected.
+ */
+
+#define CACHE_MAGIC "SWLKBG01"
+#define CACHE_DATA_OFFSET 4096
+
+struct cache_header {
+	char magic[8];
+	uint32_t width, height;
+	uint32_t stride;
+	uint32_t format;
+	uint32_t key_length;
+};
+
+static char *get_cache_dir(void) {
+	const char *cache_home = getenv("XDG_CACHE_HOME");
+	const char *suffix = "/swaylock";
+	if (!cache_home || cache_home[0] == '\0') {
+		cache_home = getenv("HOME");
+		suffix = "/.cache/swaylock";
+		if (!cache_home || cache_home[0] == '\0') {
+			return NULL;
+		}
+	}
+	size_t len = strlen(cache_home) + strlen(suffix) + 1;
+	char *dir = malloc(len);
+	if (dir) {
+		snprintf(dir, len, "%s%s", cache_home, suffix);
+	}
+	return dir;
+}
+
+static uint64_t hash_key(const char *key) {
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325;
+	for (; *key; ++key) {
+		hash ^= (unsigned char)*key;
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
+
+static char *get_cache_path(const char *key) {
+	char *dir = get_cache_dir();
+	if (!dir) {
+		return NULL;
+	}
+	size_t len = strlen(dir) + 32;
+	char *path = malloc(len);
+	if (path) {
+		snprintf(path, len, "%s/%016" PRIx64 ".argb", dir, hash_key(key));
+	}
+	free(dir);
+	return path;
+}
+
+char *background_cache_key(const char *path, enum background_mode mode,
+		uint32_t color, const char *effects, int width, int height) {
+	struct stat st;
+	if (stat(path, &st) != 0) {
+		return NULL;
+	}
+
+	const char *format = "%s\n%lld.%09ld %lld\n%d %08" PRIx32 " %dx%d\n%s";
+	int len = snprintf(NULL, 0, format, path, (long long)st.st_mtim.tv_sec,
+		st.st_mtim.tv_nsec, (long long)st.st_size, mode, color, width, height,
+		effects);
+	if (len < 0 || len + sizeof(struct cache_header) >= CACHE_DATA_OFFSET) {
+		return NULL;
+	}
+	char *key = malloc(len + 1);
+	if (key) {
+		snprintf(key, len + 1, format, path, (long long)st.st_mtim.tv_sec,
+			st.st_mtim.tv_nsec, (long long)st.st_size, mode, color,
+			width, height, effects);
+	}
+	return key;
+}
+
+// Opens the cache file for the key if it holds a background of the given
+// size, with the access mode in flags. Returns the file descriptor and its
+// size, or -1.
+static int open_cache_file(const char *key, int width, int height,
+		int flags, off_t *size) {
+	char *path = get_cache_path(key);
+	if (!path) {
+		return -1;
+	}
+	int fd = open(path, flags | O_CLOEXEC);
+	free(path);
+	if (fd == -1) {
+		return -1;
+	}
+
+	struct cache_header header;
+	size_t key_length = strlen(key);
+	char stored_key[CACHE_DATA_OFFSET];
+	struct stat st;
+	if (fstat(fd, &st) != 0 ||
+			pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+			memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+			header.width != (uint32_t)width ||
+			header.height != (uint32_t)height ||
+			header.stride != (uint32_t)width * 4 ||
+			header.format != WL_SHM_FORMAT_ARGB8888 ||
+			header.key_length != key_length ||
+			st.st_size != CACHE_DATA_OFFSET +
+				(off_t)header.stride * header.height ||
+			pread(fd, stored_key, key_length, sizeof(header)) !=
+				(ssize_t)key_length ||
+			memcmp(stored_key, key, key_length) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	*size = st.st_size;
+	return fd;
+}
+
+bool background_cache_contains(const char *key, int width, int height) {
+	off_t size;
+	int fd = open_cache_file(key, width, height, O_RDONLY, &size);
+	if (fd == -1) {
+		return false;
+	}
+	close(fd);
+	return true;
+}
+
+bool background_cache_load(struct wl_shm *shm, const char *key,
+		int width, int height, struct pool_buffer *buffer) {
+	// Compositors map shm pools for reading and writing, which fails for a
+	// read-only fd and gets the client disconnected. The file is our own and
+	// is only ever replaced by renaming, never written to in place.
+	off_t size;
+	int fd = open_cache_file(key, width, height, O_RDWR, &size);
+	if (fd == -1) {
+		return false;
+	}
+	// The compositor maps the file itself, so the pixels are never read or
+	// copied on our side
+	struct pool_buffer *result = create_buffer_from_fd(shm, buffer, fd, size,
+		CACHE_DATA_OFFSET, width, height, width * 4, WL_SHM_FORMAT_ARGB8888);
+	close(fd);
+	return result != NULL;
+}
+
+static bool write_all(int fd, const void *data, size_t size) {
+	const char *ptr = data;
+	while (size > 0) {
+		ssize_t amt = write(fd, ptr, size);
+		if (amt < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		ptr += amt;
+		size -= amt;
+	}
+	return true;
+}
+
+static bool make_cache_dir(void) {
+	char *dir = get_cache_dir();
+	if (!dir) {
+		return false;
+	}
+	// Create the parent first, in case $HOME/.cache does not exist yet
+	char *slash = strrchr(dir, '/');
+	if (slash && slash != dir) {
+		*slash = '\0';
+		mkdir(dir, 0700);
+		*slash = '/';
+	}
+	bool ok = mkdir(dir, 0700) == 0 || errno == EEXIST;
+	free(dir);
+	return ok;
+}
+
+bool background_cache_store(const char *key, const struct pool_buffer *buffer) {
+	if (!buffer->data || !make_cache_dir()) {
+		return false;
+	}
+	char *path = get_cache_path(key);
+	if (!path) {
+		return false;
+	}
+	size_t tmp_len = strlen(path) + 32;
+	char *tmp_path = malloc(tmp_len);
+	if (!tmp_path) {
+		free(path);
+		return false;
+	}
+	snprintf(tmp_path, tmp_len, "%s.%d.tmp", path, (int)getpid());
+
+	bool result = false;
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		swaylock_log_errno(LOG_DEBUG, "Failed to create %s", tmp_path);
+		goto out;
+	}
+
+	char page[CACHE_DATA_OFFSET] = {0};
+	struct cache_header header = {
+		.magic = CACHE_MAGIC,
+		.width = buffer->width,
+		.height = buffer->height,
+		.stride = buffer->width * 4,
+		.format = WL_SHM_FORMAT_ARGB8888,
+		.key_length = strlen(key),
+	};
+	memcpy(page, &header, sizeof(header));
+	memcpy(page + sizeof(header), key, header.key_length);
+
+	bool written = write_all(fd, page, sizeof(page));
+	if (buffer->stride == header.stride) {
+		written = written && write_all(fd, buffer->data,
+			(size_t)header.stride * header.height);
+	} else {
+		// dmabufs may have padded rows
+		for (uint32_t y = 0; written && y < header.height; ++y) {
+			written = write_all(fd, (const char *)buffer->data +
+				(size_t)y * buffer->stride, header.stride);
+		}
+	}
+	if (close(fd) != 0 || !written) {
+		swaylock_log_errno(LOG_DEBUG, "Failed to write %s", tmp_path);
+		unlink(tmp_path);
+		goto out;
+	}
+	if (rename(tmp_path, path) != 0) {
+		swaylock_log_errno(LOG_DEBUG, "Failed to rename %s", tmp_path);
+		unlink(tmp_path);
+		goto out;
+	}
+	swaylock_log(LOG_DEBUG, "Stored background in %s", path);
+	result = true;
+
+out:
+	free(tmp_path);
+	free(path);
+	return result;
+}
@@ -1,7 +1,9 @@
 #include <assert.h>
+#include <math.h>
 #include "background-image.h"
 #include "cairo.h"
 #include "log.h"
+#include "resample.h"
 
 enum background_mode parse_background_mode(const char *mode) {
 	if (strcmp(mode, "stretch") == 0) {
@@ -52,8 +54,194 @@ cairo_surface_t *load_background_image(const char *path) {
 	return image;
 }
 
+static void get_load_size(enum background_mode mode,
+		int image_width, int image_height, int max_width, int max_height,
+		int *width, int *height) {
+	*width = image_width;
+	*height = image_height;
+	if (max_width <= 0 || max_height <= 0) {
+		return;
+	}
+
+	double scale_x = (double)max_width / image_width;
+	double scale_y = (double)max_height / image_height;
+	switch (mode) {
+	case BACKGROUND_MODE_STRETCH:
+		break;
+	case BACKGROUND_MODE_FILL:
+		scale_x = scale_y = fmax(scale_x, scale_y);
+		break;
+	case BACKGROUND_MODE_FIT:
+		scale_x = scale_y = fmin(scale_x, scale_y);
+		break;
+	case BACKGROUND_MODE_CENTER:
+	case BACKGROUND_MODE_TILE:
+	case BACKGROUND_MODE_SOLID_COLOR:
+	case BACKGROUND_MODE_INVALID:
+		// These show the image pixel for pixel
+		return;
+	}
+
+	// Only ever scale down, upscaling is left to render_background_image
+	if (scale_x < 1) {
+		*width = ceil(image_width * scale_x);
+	}
+	if (scale_y < 1) {
+		*height = ceil(image_height * scale_y);
+	}
+}
+
+cairo_surface_t *load_background_image_at_size(const char *path,
+		enum background_mode mode, int max_width, int max_height) {
+	if (max_width <= 0 || max_height <= 0) {
+		return load_background_image(path);
+	}
+
+	int width, height;
+#if HAVE_GDK_PIXBUF
+	int image_width, image_height;
+	if (!gdk_pixbuf_get_file_info(path, &image_width, &image_height)) {
+		return load_background_image(path);
+	}
+	get_load_size(mode, image_width, image_height, max_width, max_height,
+		&width, &height);
+	if (width == image_width && height == image_height) {
+		return load_background_image(path);
+	}
+
+	// Let the decoder do the scaling, which for some formats (like JPEG)
+	// means the full size image is never decoded at all
+	GError *err = NULL;
+	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file_at_scale(path, width, height,
+		mode != BACKGROUND_MODE_STRETCH, &err);
+	if (!pixbuf) {
+		swaylock_log(LOG_ERROR, "Failed to load background image (%s).",
+				err->message);
+		g_error_free(err);
+		return NULL;
+	}
+	cairo_surface_t *image = gdk_cairo_image_surface_create_from_pixbuf(pixbuf);
+	g_object_unref(pixbuf);
+	if (!image || cairo_surface_status(image) != CAIRO_STATUS_SUCCESS) {
+		swaylock_log(LOG_ERROR, "Failed to read background image.");
+		if (image) {
+			cairo_surface_destroy(image);
+		}
+		return NULL;
+	}
+#else
+	cairo_surface_t *full = load_background_image(path);
+	if (!full) {
+		return NULL;
+	}
+	int image_width = cairo_image_surface_get_width(full);
+	int image_height = cairo_image_surface_get_height(full);
+	get_load_size(mode, image_width, image_height, max_width, max_height,
+		&width, &height);
+	if (width == image_width && height == image_height) {
+		return full;
+	}
+
+	cairo_surface_t *image = cairo_image_surface_create(
+		cairo_image_surface_get_format(full), width, height);
+	if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(image);
+		return full;
+	}
+	cairo_t *cairo = cairo_create(image);
+	cairo_scale(cairo, (double)width / image_width,
+		(double)height / image_height);
+	cairo_set_source_surface(cairo, full, 0, 0);
+	cairo_pattern_set_filter(cairo_get_source(cairo), CAIRO_FILTER_BEST);
+	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+	cairo_paint(cairo);
+	cairo_destroy(cairo);
+	cairo_surface_destroy(full);
+#endif // HAVE_GDK_PIXBUF
+	swaylock_log(LOG_DEBUG, "Loaded %s at %dx%d instead of %dx%d", path,
+			width, height, image_width, image_height);
+	return image;
+}
+
+// Draws downscaled images straight into the buffer, which is a lot faster
+// than having cairo filter them. Returns false if cairo has to do it instead.
+static bool resample_background_image(cairo_t *cairo, cairo_surface_t *image,
+		enum background_mode mode, int buffer_width, int buffer_height) {
+	cairo_surface_t *target = cairo_get_target(cairo);
+	if (cairo_surface_get_type(target) != CAIRO_SURFACE_TYPE_IMAGE ||
+			cairo_surface_get_type(image) != CAIRO_SURFACE_TYPE_IMAGE) {
+		return false;
+	}
+	cairo_format_t target_format = cairo_image_surface_get_format(target);
+	cairo_format_t format = cairo_image_surface_get_format(image);
+	if ((target_format != CAIRO_FORMAT_ARGB32 &&
+				target_format != CAIRO_FORMAT_RGB24) ||
+			(format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24)) {
+		return false;
+	}
+	cairo_matrix_t matrix;
+	cairo_get_matrix(cairo, &matrix);
+	if (cairo_get_operator(cairo) != CAIRO_OPERATOR_OVER ||
+			matrix.xx != 1 || matrix.yx != 0 || matrix.xy != 0 ||
+			matrix.yy != 1 || matrix.x0 != 0 || matrix.y0 != 0) {
+		return false;
+	}
+
+	// The same placement as below
+	int width = cairo_image_surface_get_width(image);
+	int height = cairo_image_surface_get_height(image);
+	double window_ratio = (double)buffer_width / buffer_height;
+	double bg_ratio = (double)width / height;
+	double scale_x, scale_y, x = 0, y = 0;
+	switch (mode) {
+	case BACKGROUND_MODE_STRETCH:
+		scale_x = (double)buffer_width / width;
+		scale_y = (double)buffer_height / height;
+		break;
+	case BACKGROUND_MODE_FILL:
+	case BACKGROUND_MODE_FIT:
+		if ((window_ratio > bg_ratio) == (mode == BACKGROUND_MODE_FILL)) {
+			scale_x = scale_y = (double)buffer_width / width;
+			y = (double)buffer_height / 2 - height * scale_y / 2;
+		} else {
+			scale_x = scale_y = (double)buffer_height / height;
+			x = (double)buffer_width / 2 - width * scale_x / 2;
+		}
+		break;
+	case BACKGROUND_MODE_CENTER:
+	case BACKGROUND_MODE_TILE:
+	case BACKGROUND_MODE_SOLID_COLOR:
+	case BACKGROUND_MODE_INVALID:
+		return false;
+	}
+	// Upscaling is rare, and cairo does it well enough
+	if (scale_x > 1 || scale_y > 1) {
+		return false;
+	}
+
+	cairo_surface_flush(target);
+	cairo_surface_flush(image);
+	if (!resample_over((const uint32_t *)cairo_image_surface_get_data(image),
+			cairo_image_surface_get_stride(image), width, height,
+			format == CAIRO_FORMAT_RGB24,
+			(uint32_t *)cairo_image_surface_get_data(target),
+			cairo_image_surface_get_stride(target),
+			cairo_image_surface_get_width(target),
+			cairo_image_surface_get_height(target),
+			scale_x, scale_y, x, y)) {
+		return false;
+	}
+	cairo_surface_mark_dirty(target);
+	return true;
+}
+
 void render_background_image(cairo_t *cairo, cairo_surface_t *image,
 		enum background_mode mode, int buffer_width, int buffer_height) {
+	if (resample_background_image(cairo, image, mode,
+			buffer_width, buffer_height)) {
+		return;
+	}
+
 	double width = cairo_image_surface_get_width(image);
 	double height = cairo_image_surface_get_height(image);
 
@@ -0,0 +1,106 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wayland-client.h>
+#include "background-cache.h"
+#include "headless.h"
+#include "log.h"
+#include "pool-buffer.h"
+
+/*
+ * Stores a background in the disk cache, loads it back the way render.c
+ * does on a cache hit and checks that the compositor could map the pool and
+ * would see the stored pixels.
+ */
+
+#define WIDTH 33
+#define HEIGHT 7
+// Offset of the pixels in cache files
+#define DATA_OFFSET 4096
+
+static bool fail(const char *message) {
+	fprintf(stderr, "cache-test: %s\n", message);
+	return false;
+}
+
+static bool run(struct wl_shm *shm, const char *image_path) {
+	uint32_t pixels[WIDTH * HEIGHT];
+	for (size_t i = 0; i < sizeof(pixels) / sizeof(pixels[0]); ++i) {
+		pixels[i] = 0xFF000000 | (uint32_t)(i * 2654435761u >> 8);
+	}
+	struct pool_buffer stored = {
+		.width = WIDTH,
+		.height = HEIGHT,
+		.stride = WIDTH * 4,
+		.data = pixels,
+	};
+
+	char *key = background_cache_key(image_path, BACKGROUND_MODE_FILL,
+		0xFFFFFFFF, "", WIDTH, HEIGHT);
+	if (!key) {
+		return fail("no key for the image");
+	}
+	bool ok = false;
+	if (!background_cache_store(key, &stored)) {
+		fail("failed to store background");
+		goto out;
+	}
+	if (!background_cache_contains(key, WIDTH, HEIGHT)) {
+		fail("stored background not found");
+		goto out;
+	}
+	if (background_cache_contains(key, WIDTH + 1, HEIGHT)) {
+		fail("background found at the wrong size");
+		goto out;
+	}
+
+	struct pool_buffer loaded = {0};
+	if (!background_cache_load(shm, key, WIDTH, HEIGHT, &loaded)) {
+		fail("failed to load background");
+		goto out;
+	}
+	const void *pool;
+	size_t pool_size;
+	if (!headless_last_pool(&pool, &pool_size)) {
+		fail("cache file can't be mapped as a shm pool");
+	} else if (pool_size != DATA_OFFSET + sizeof(pixels)) {
+		fail("shm pool has the wrong size");
+	} else if (memcmp((const char *)pool + DATA_OFFSET, pixels,
+				sizeof(pixels)) != 0) {
+		fail("shm pool doesn't hold the stored pixels");
+	} else {
+		ok = true;
+	}
+	destroy_buffer(&loaded);
+
+out:
+	free(key);
+	return ok;
+}
+
+int main(int argc, char **argv) {
+	swaylock_log_init(LOG_ERROR);
+
+	char dir[] = "/tmp/swaylock-cache-test.XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	setenv("XDG_CACHE_HOME", dir, 1);
+
+	// Any file works as the image, the key only looks at its metadata
+	struct wl_shm *shm =
+		(struct wl_shm *)headless_proxy_create(&wl_shm_interface);
+	bool ok = run(shm, argv[0]);
+	headless_proxy_destroy((struct wl_proxy *)shm);
+
+	char command[sizeof(dir) + 16];
+	snprintf(command, sizeof(command), "rm -rf '%s'", dir);
+	if (system(command) != 0) {
+		fprintf(stderr, "cache-test: failed to remove %s\n", dir);
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,153 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdarg.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <wayland-client.h>
+#include "headless.h"
+#include "log.h"
+
+/*
+ * The generated protocol code sends every request through these functions.
+ * Defining them in the benchmark makes its own calls resolve here rather
+ * than to libwayland-client, which is still linked for the interfaces.
+ */
+
+struct wl_proxy {
+	const struct wl_interface *interface;
+	uint32_t version;
+	void (**implementation)(void);
+	void *data;
+	// wl_surface only: the buffer attached since the last commit, and the
+	// one committed
+	struct wl_proxy *pending, *committed;
+	bool attached;
+	struct wl_list link;
+};
+
+static struct wl_list proxies = { &proxies, &proxies };
+
+// The most recently created shm pool, mapped the way compositors map them
+static void *pool_data = MAP_FAILED;
+static size_t pool_size;
+
+bool headless_last_pool(const void **data, size_t *size) {
+	if (pool_data == MAP_FAILED) {
+		return false;
+	}
+	*data = pool_data;
+	*size = pool_size;
+	return true;
+}
+
+static void map_pool(int fd, int32_t size) {
+	if (pool_data != MAP_FAILED) {
+		munmap(pool_data, pool_size);
+	}
+	// libwayland-server maps every pool writable, an fd that doesn't allow
+	// that is a protocol error there
+	pool_size = size;
+	pool_data = mmap(NULL, pool_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		fd, 0);
+	if (pool_data == MAP_FAILED) {
+		swaylock_log_errno(LOG_ERROR, "Compositor would fail to map shm pool");
+	}
+}
+
+static struct wl_proxy *create_proxy(const struct wl_interface *interface,
+		uint32_t version) {
+	struct wl_proxy *proxy = calloc(1, sizeof(*proxy));
+	if (!proxy) {
+		swaylock_log(LOG_ERROR, "Failed to allocate proxy");
+		abort();
+	}
+	proxy->interface = interface;
+	proxy->version = version;
+	wl_list_insert(&proxies, &proxy->link);
+	return proxy;
+}
+
+struct wl_proxy *headless_proxy_create(const struct wl_interface *interface) {
+	return create_proxy(interface, interface->version);
+}
+
+void headless_proxy_destroy(struct wl_proxy *proxy) {
+	// Surfaces no longer show a buffer that is gone
+	struct wl_proxy *other;
+	wl_list_for_each(other, &proxies, link) {
+		if (other->pending == proxy) {
+			other->pending = NULL;
+		}
+		if (other->committed == proxy) {
+			other->committed = NULL;
+		}
+	}
+	wl_list_remove(&proxy->link);
+	free(proxy);
+}
+
+static void release_buffer(struct wl_proxy *buffer) {
+	if (!buffer || !buffer->implementation) {
+		return;
+	}
+	const struct wl_buffer_listener *listener =
+		(const struct wl_buffer_listener *)buffer->implementation;
+	if (listener->release) {
+		listener->release(buffer->data, (struct wl_buffer *)buffer);
+	}
+}
+
+struct wl_proxy *wl_proxy_marshal_flags(struct wl_proxy *proxy, uint32_t opcode,
+		const struct wl_interface *interface, uint32_t version,
+		uint32_t flags, ...) {
+	if (proxy->interface == &wl_surface_interface) {
+		if (opcode == WL_SURFACE_ATTACH) {
+			va_list args;
+			va_start(args, flags);
+			proxy->pending = va_arg(args, struct wl_proxy *);
+			proxy->attached = true;
+			va_end(args);
+		} else if (opcode == WL_SURFACE_COMMIT && proxy->attached) {
+			if (proxy->committed != proxy->pending) {
+				release_buffer(proxy->committed);
+			}
+			proxy->committed = proxy->pending;
+			proxy->attached = false;
+		}
+	} else if (proxy->interface == &wl_shm_interface &&
+			opcode == WL_SHM_CREATE_POOL) {
+		va_list args;
+		va_start(args, flags);
+		va_arg(args, void *); // new_id
+		int fd = va_arg(args, int);
+		int32_t size = va_arg(args, int32_t);
+		va_end(args);
+		map_pool(fd, size);
+	}
+
+	if (flags & WL_MARSHAL_FLAG_DESTROY) {
+		headless_proxy_destroy(proxy);
+		return NULL;
+	}
+	if (interface) {
+		return create_proxy(interface, version);
+	}
+	return NULL;
+}
+
+uint32_t wl_proxy_get_version(struct wl_proxy *proxy) {
+	return proxy->version;
+}
+
+int wl_proxy_add_listener(struct wl_proxy *proxy,
+		void (**implementation)(void), void *data) {
+	if (proxy->implementation) {
+		return -1;
+	}
+	proxy->implementation = implementation;
+	proxy->data = data;
+	return 0;
+}
+
+void wl_proxy_destroy(struct wl_proxy *proxy) {
+	headless_proxy_destroy(proxy);
+}
@@ -0,0 +1,23 @@
+#ifndef _SWAYLOCK_BENCH_HEADLESS_H
+#define _SWAYLOCK_BENCH_HEADLESS_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <wayland-client.h>
+
+/**
+ * A stand-in for libwayland-client's proxies, so render.c can run without a
+ * compositor. Requests go nowhere, except that surfaces keep track of the
+ * buffer committed to them and release the one they showed before, the way
+ * a compositor that is done with a buffer once it is replaced would. shm
+ * pools are mapped like a compositor maps them.
+ */
+
+// Creates an object as if it had been bound from the registry.
+struct wl_proxy *headless_proxy_create(const struct wl_interface *interface);
+// Destroys a proxy created by headless_proxy_create.
+void headless_proxy_destroy(struct wl_proxy *proxy);
+// The contents of the shm pool created last. Fails if there is none or the
+// compositor couldn't have mapped it.
+bool headless_last_pool(const void **data, size_t *size);
+
+#endif
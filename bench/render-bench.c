@@ -0,0 +1,388 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-client.h>
+#include "background-image.h"
+#include "cairo.h"
+#include "clock.h"
+#include "headless.h"
+#include "log.h"
+#include "pool-buffer.h"
+#include "swaylock.h"
+
+/*
+ * Renders backgrounds and indicators for every background mode, at output
+ * sizes from 1080p to 8K and integer scales 1 to 3, without a compositor.
+ * Each configuration prints one line with the time per frame of:
+ *
+ *   background  rendering a background that isn't cached yet: allocating
+ *               its buffer and drawing the image in
+ *   first       the first render_frame_background and render_frame of a
+ *               new output, which renders its background as well
+ *   typing, backspace, clear, wrong
+ *               render_frame while the state changes on every frame, the
+ *               way it does for that kind of input
+ *
+ * followed by the peak RSS of the process so far.
+ */
+
+struct output_size {
+	int width, height;
+};
+
+static const struct output_size output_sizes[] = {
+	{ 1920, 1080 },
+	{ 2560, 1440 },
+	{ 3840, 2160 },
+	{ 5120, 2880 },
+	{ 7680, 4320 },
+};
+
+#define MAX_SCALE 3
+
+static const char *const mode_names[] = {
+	[BACKGROUND_MODE_STRETCH] = "stretch",
+	[BACKGROUND_MODE_FILL] = "fill",
+	[BACKGROUND_MODE_FIT] = "fit",
+	[BACKGROUND_MODE_CENTER] = "center",
+	[BACKGROUND_MODE_TILE] = "tile",
+	[BACKGROUND_MODE_SOLID_COLOR] = "solid",
+};
+
+enum input_sequence {
+	SEQUENCE_TYPING,
+	SEQUENCE_BACKSPACE,
+	SEQUENCE_CLEAR,
+	SEQUENCE_WRONG,
+	SEQUENCE_COUNT,
+};
+
+static const char *const sequence_names[] = {
+	[SEQUENCE_TYPING] = "typing",
+	[SEQUENCE_BACKSPACE] = "backspace",
+	[SEQUENCE_CLEAR] = "clear",
+	[SEQUENCE_WRONG] = "wrong",
+};
+
+// Background images only get loaded ahead of time here, and frames are
+// rendered as fast as possible rather than when something changed
+void schedule_image_load(struct swaylock_state *state,
+		struct swaylock_image *image) {
+}
+
+void damage_state(struct swaylock_state *state) {
+}
+
+static int64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static long peak_rss_kib(void) {
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) {
+		return -1;
+	}
+	return usage.ru_maxrss;
+}
+
+// A photo-like image, for when none is given: a gradient with some circles
+// on it, so scaling it isn't trivially cheap
+static cairo_surface_t *create_test_image(void) {
+	int width = 2560, height = 1600;
+	cairo_surface_t *image = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+		width, height);
+	cairo_t *cairo = cairo_create(image);
+	cairo_pattern_t *gradient = cairo_pattern_create_linear(0, 0,
+		width, height);
+	cairo_pattern_add_color_stop_rgb(gradient, 0, 0.1, 0.2, 0.4);
+	cairo_pattern_add_color_stop_rgb(gradient, 1, 0.9, 0.5, 0.2);
+	cairo_set_source(cairo, gradient);
+	cairo_paint(cairo);
+	cairo_pattern_destroy(gradient);
+	for (int i = 0; i < 64; ++i) {
+		cairo_arc(cairo, (i * 397) % width, (i * 211) % height,
+			20 + (i * 37) % 200, 0, 2 * 3.14159265358979323846);
+		cairo_set_source_rgba(cairo, (i % 3) / 2.0, (i % 5) / 4.0,
+			(i % 7) / 6.0, 0.5);
+		cairo_fill(cairo);
+	}
+	cairo_destroy(cairo);
+	cairo_surface_flush(image);
+	return image;
+}
+
+static void init_state(struct swaylock_state *state) {
+	*state = (struct swaylock_state){
+		.args = {
+			.show_indicator = true,
+			.radius = 50,
+			.thickness = 10,
+			.indicator_x_position = -1,
+			.indicator_y_position = -1,
+			.indicator_buffers = 3,
+			.mode = BACKGROUND_MODE_FILL,
+			.font = strdup("sans-serif"),
+			.clock = true,
+			.timestr = strdup("%T"),
+			.datestr = strdup("%a, %x"),
+			.colors = {
+				.background = 0x95A5A6FF,
+				.text = 0x2C3E50FF,
+				.highlight_bs = 0xE67E22FF,
+				.highlight_key = 0x1ABC9CFF,
+				.ring = 0x3498DBF,
+				.highlight_clear = 0x27AE60FF,
+				.highlight_ver = 0x7f8C8DFF,
+				.highlight_wrong = 0xC0392BFF,
+			},
+		},
+		.auth_ready = true,
+	};
+	state->compositor = (struct wl_compositor *)
+		headless_proxy_create(&wl_compositor_interface);
+	state->subcompositor = (struct wl_subcompositor *)
+		headless_proxy_create(&wl_subcompositor_interface);
+	state->shm = (struct wl_shm *)headless_proxy_create(&wl_shm_interface);
+	wl_list_init(&state->surfaces);
+	wl_list_init(&state->images);
+	wl_list_init(&state->backgrounds);
+	wl_list_init(&state->indicator_groups);
+	wl_list_init(&state->fonts);
+}
+
+static struct swaylock_surface *create_surface(struct swaylock_state *state,
+		struct swaylock_image *image, const struct output_size *size,
+		int scale) {
+	struct swaylock_surface *surface = calloc(1, sizeof(*surface));
+	if (!surface) {
+		swaylock_log(LOG_ERROR, "Failed to allocate surface");
+		return NULL;
+	}
+	surface->state = state;
+	surface->image = image;
+	surface->surface = wl_compositor_create_surface(state->compositor);
+	surface->child = wl_compositor_create_surface(state->compositor);
+	surface->subsurface = wl_subcompositor_get_subsurface(state->subcompositor,
+		surface->child, surface->surface);
+	surface->created = true;
+	surface->width = size->width / scale;
+	surface->height = size->height / scale;
+	surface->scale = scale;
+	surface->subpixel = WL_OUTPUT_SUBPIXEL_HORIZONTAL_RGB;
+	surface->output_name = strdup("bench");
+	wl_list_insert(&state->surfaces, &surface->link);
+	return surface;
+}
+
+static void destroy_surface(struct swaylock_surface *surface) {
+	wl_list_remove(&surface->link);
+	release_indicator(surface);
+	if (surface->background) {
+		release_background(surface->state, surface->background);
+	}
+	wl_subsurface_destroy(surface->subsurface);
+	wl_surface_destroy(surface->child);
+	wl_surface_destroy(surface->surface);
+	free(surface->output_name);
+	free(surface);
+}
+
+// What get_background does when nothing fitting is cached
+static bool render_background(struct swaylock_state *state,
+		cairo_surface_t *image, int width, int height) {
+	struct pool_buffer buffer = {0};
+	if (!create_buffer(state->shm, &buffer, width, height,
+				WL_SHM_FORMAT_ARGB8888)) {
+		swaylock_log(LOG_ERROR, "Failed to create %dx%d buffer",
+			width, height);
+		return false;
+	}
+	cairo_t *cairo = buffer.cairo;
+	cairo_set_antialias(cairo, CAIRO_ANTIALIAS_BEST);
+	cairo_save(cairo);
+	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_u32(cairo, state->args.colors.background);
+	cairo_paint(cairo);
+	if (image) {
+		cairo_set_operator(cairo, CAIRO_OPERATOR_OVER);
+		render_background_image(cairo, image, state->args.mode,
+			width, height);
+	}
+	cairo_restore(cairo);
+	finish_buffer(&buffer);
+	destroy_buffer(&buffer);
+	return true;
+}
+
+// Sets up the state for the next frame of the input sequence. The typing
+// highlight moves on every frame, as it does on every key press.
+static void apply_input(struct swaylock_state *state,
+		enum input_sequence sequence, int frame) {
+	state->auth_state = AUTH_STATE_IDLE;
+	state->input_state = INPUT_STATE_LETTER;
+	state->highlight_start = (state->highlight_start + 311) % 2048;
+	switch (sequence) {
+	case SEQUENCE_TYPING:
+		break;
+	case SEQUENCE_BACKSPACE:
+		if (frame % 2) {
+			state->input_state = INPUT_STATE_BACKSPACE;
+		}
+		break;
+	case SEQUENCE_CLEAR:
+		if (frame % 2) {
+			state->input_state = INPUT_STATE_CLEAR;
+		}
+		break;
+	case SEQUENCE_WRONG:
+		if (frame % 3 == 1) {
+			state->auth_state = AUTH_STATE_VALIDATING;
+			state->input_state = INPUT_STATE_IDLE;
+		} else if (frame % 3 == 2) {
+			state->auth_state = AUTH_STATE_INVALID;
+			state->input_state = INPUT_STATE_CLEAR;
+		}
+		break;
+	case SEQUENCE_COUNT:
+		abort();
+	}
+}
+
+static bool run_config(struct swaylock_state *state,
+		struct swaylock_image *image, enum background_mode mode,
+		const struct output_size *size, int scale,
+		int background_iterations, int frames) {
+	state->args.mode = mode;
+	cairo_surface_t *source = mode == BACKGROUND_MODE_SOLID_COLOR ?
+		NULL : image->cairo_surface;
+
+	int64_t start = now_ns();
+	for (int i = 0; i < background_iterations; ++i) {
+		if (!render_background(state, source, size->width, size->height)) {
+			return false;
+		}
+	}
+	double background_ns = (double)(now_ns() - start) /
+		background_iterations;
+
+	start = now_ns();
+	struct swaylock_surface *surface = create_surface(state, image,
+		size, scale);
+	if (!surface) {
+		return false;
+	}
+	render_frame_background(surface);
+	render_frame(surface);
+	double first_ns = now_ns() - start;
+
+	double sequence_ns[SEQUENCE_COUNT];
+	for (int sequence = 0; sequence < SEQUENCE_COUNT; ++sequence) {
+		start = now_ns();
+		for (int frame = 0; frame < frames; ++frame) {
+			apply_input(state, sequence, frame);
+			render_frame(surface);
+		}
+		sequence_ns[sequence] = (double)(now_ns() - start) / frames;
+	}
+	destroy_surface(surface);
+
+	printf("%-8s %5dx%-5d %5d %12.0f %12.0f", mode_names[mode],
+		size->width, size->height, scale, background_ns, first_ns);
+	for (int sequence = 0; sequence < SEQUENCE_COUNT; ++sequence) {
+		printf(" %10.0f", sequence_ns[sequence]);
+	}
+	printf(" %12ld\n", peak_rss_kib());
+	fflush(stdout);
+	return true;
+}
+
+static const char usage[] =
+	"Usage: render-bench [options...]\n"
+	"\n"
+	"  -h          Show help message and quit.\n"
+	"  -i <path>   Use the image at <path> instead of a generated one.\n"
+	"  -b <count>  Render each background <count> times, 3 by default.\n"
+	"  -n <count>  Render <count> frames per input sequence, 60 by default.\n"
+	"\n"
+	"Times are in ns per frame, the peak RSS in KiB.\n";
+
+int main(int argc, char **argv) {
+	swaylock_log_init(LOG_ERROR);
+
+	const char *image_path = NULL;
+	int background_iterations = 3;
+	int frames = 60;
+	int c;
+	while ((c = getopt(argc, argv, "hi:b:n:")) != -1) {
+		switch (c) {
+		case 'i':
+			image_path = optarg;
+			break;
+		case 'b':
+			background_iterations = atoi(optarg);
+			break;
+		case 'n':
+			frames = atoi(optarg);
+			break;
+		case 'h':
+			fprintf(stdout, "%s", usage);
+			return EXIT_SUCCESS;
+		default:
+			fprintf(stderr, "%s", usage);
+			return EXIT_FAILURE;
+		}
+	}
+	if (background_iterations <= 0 || frames <= 0) {
+		fprintf(stderr, "%s", usage);
+		return EXIT_FAILURE;
+	}
+
+	struct swaylock_state state;
+	init_state(&state);
+	clock_init(&state);
+
+	struct swaylock_image image = {
+		.load_state = IMAGE_LOADED,
+	};
+	if (image_path) {
+		image.cairo_surface = load_background_image(image_path);
+		if (!image.cairo_surface) {
+			return EXIT_FAILURE;
+		}
+	} else {
+		image.cairo_surface = create_test_image();
+	}
+
+	printf("%-8s %11s %5s %12s %12s", "mode", "output", "scale",
+		"background", "first");
+	for (int sequence = 0; sequence < SEQUENCE_COUNT; ++sequence) {
+		printf(" %10s", sequence_names[sequence]);
+	}
+	printf(" %12s\n", "peak_rss");
+
+	for (int mode = 0; mode < BACKGROUND_MODE_INVALID; ++mode) {
+		for (size_t i = 0; i < sizeof(output_sizes) / sizeof(output_sizes[0]);
+				++i) {
+			for (int scale = 1; scale <= MAX_SCALE; ++scale) {
+				if (!run_config(&state, &image, mode, &output_sizes[i],
+						scale, background_iterations, frames)) {
+					return EXIT_FAILURE;
+				}
+			}
+		}
+	}
+
+	destroy_fonts(&state);
+	clock_finish();
+	cairo_surface_destroy(image.cairo_surface);
+	free(state.args.font);
+	free(state.args.timestr);
+	free(state.args.datestr);
+	return EXIT_SUCCESS;
+}
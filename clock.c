@@ -0,0 +1,169 @@
+#define _POSIX_C_SOURCE 200809L
+#include <locale.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "clock.h"
+#include "log.h"
+#include "loop.h"
+#include "swaylock.h"
+
+// The smallest unit of time a format shows, so its text stays the same
+// until the next one starts
+enum clock_unit {
+	CLOCK_UNIT_SECOND,
+	CLOCK_UNIT_MINUTE,
+	CLOCK_UNIT_DAY,
+};
+
+struct clock_text {
+	const char *format; // NULL or empty for no text
+	enum clock_unit unit;
+	// The text was formatted at formatted_at and shows the same up to
+	// valid_until, both in seconds since the epoch
+	time_t formatted_at, valid_until;
+	char text[256];
+};
+
+static locale_t clock_locale = (locale_t)0;
+static struct clock_text time_text, date_text;
+
+static enum clock_unit format_unit(const char *format) {
+	enum clock_unit unit = CLOCK_UNIT_DAY;
+	for (const char *p = format; p && *p; ++p) {
+		if (*p != '%') {
+			continue;
+		}
+		++p;
+		// Skip the flags, field width and E/O modifiers glibc allows
+		p += strspn(p, "_-0^#");
+		p += strspn(p, "0123456789");
+		p += strspn(p, "EO");
+		switch (*p) {
+		case '\0':
+			return unit;
+		case 'S': // second
+		case 'T': // %H:%M:%S
+		case 'r': // %I:%M:%S %p
+		case 's': // seconds since the epoch
+		case 'X': // locale time, usually with seconds
+		case 'c': // locale date and time, likewise
+			return CLOCK_UNIT_SECOND;
+		}
+		// Anything that isn't known to be a part of the date may change
+		// within a day, e.g. hours, minutes or the time zone
+		if (!strchr("aAbBCdDeFgGhjmnuUVwWxyYt%", *p)) {
+			unit = CLOCK_UNIT_MINUTE;
+		}
+	}
+	return unit;
+}
+
+// Seconds from the time until the next unit starts
+static int seconds_until_change(const struct tm *tm, enum clock_unit unit) {
+	int seconds = 1;
+	switch (unit) {
+	case CLOCK_UNIT_SECOND:
+		break;
+	case CLOCK_UNIT_MINUTE:
+		seconds = 60 - tm->tm_sec;
+		break;
+	case CLOCK_UNIT_DAY:
+		seconds = ((23 - tm->tm_hour) * 60 + (59 - tm->tm_min)) * 60 +
+			60 - tm->tm_sec;
+		break;
+	}
+	return seconds < 1 ? 1 : seconds; // leap second
+}
+
+static void init_text(struct clock_text *text, const char *format) {
+	*text = (struct clock_text){
+		.format = format,
+		.unit = format_unit(format),
+	};
+}
+
+void clock_init(struct swaylock_state *state) {
+	// localtime_r doesn't look for time zone changes on its own
+	tzset();
+	clock_locale = newlocale(LC_TIME_MASK, "", (locale_t)0);
+	if (clock_locale == (locale_t)0) {
+		swaylock_log_errno(LOG_ERROR, "Unable to load the locale for the clock");
+		clock_locale = newlocale(LC_TIME_MASK, "C", (locale_t)0);
+	}
+	init_text(&time_text, state->args.timestr);
+	init_text(&date_text, state->args.datestr);
+}
+
+void clock_finish(void) {
+	if (clock_locale != (locale_t)0) {
+		freelocale(clock_locale);
+		clock_locale = (locale_t)0;
+	}
+}
+
+static const char *get_text(struct clock_text *text, time_t now) {
+	if (!text->format || !text->format[0]) {
+		return NULL;
+	}
+	// The wall clock may have been set back as well
+	if (now >= text->formatted_at && now < text->valid_until) {
+		return text->text;
+	}
+
+	struct tm tm;
+	localtime_r(&now, &tm);
+	if (clock_locale == (locale_t)0 || strftime_l(text->text,
+				sizeof(text->text), text->format, &tm, clock_locale) == 0) {
+		text->text[0] = '\0';
+	}
+	text->formatted_at = now;
+	text->valid_until = now + seconds_until_change(&tm, text->unit);
+	return text->text;
+}
+
+void clock_get_text(const char **time_str, const char **date_str) {
+	time_t now = time(NULL);
+	*time_str = get_text(&time_text, now);
+	*date_str = get_text(&date_text, now);
+}
+
+// Milliseconds until just after the next unit starts
+static int ms_until_tick(enum clock_unit unit) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	struct tm tm = {0};
+	if (unit != CLOCK_UNIT_SECOND) {
+		localtime_r(&now.tv_sec, &tm);
+	}
+	int seconds = seconds_until_change(&tm, unit);
+	// The loop only has millisecond precision, round up so the timer
+	// doesn't fire right before the text changes
+	return seconds * 1000 - now.tv_nsec / 1000000 + 1;
+}
+
+static void clock_tick(void *data) {
+	struct swaylock_state *state = data;
+	state->clock_timer = NULL;
+	damage_state(state);
+	schedule_clock(state);
+}
+
+void schedule_clock(struct swaylock_state *state) {
+	if (state->clock_timer) {
+		loop_remove_timer(state->eventloop, state->clock_timer);
+		state->clock_timer = NULL;
+	}
+	if (!state->args.clock) {
+		return;
+	}
+
+	enum clock_unit unit = format_unit(state->args.timestr);
+	enum clock_unit date_unit = format_unit(state->args.datestr);
+	if (date_unit < unit) {
+		unit = date_unit;
+	}
+	state->clock_timer = loop_add_timer_slack(state->eventloop,
+		ms_until_tick(unit), state->args.timer_slack, clock_tick, state);
+}
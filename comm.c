@@ -1,5 +1,13 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include "comm.h"
@@ -7,45 +15,247 @@
 #include "swaylock.h"
 #include "password-buffer.h"
 
+/*
+ * Every message starts with a header and is followed by len bytes of
+ * payload. Messages are never larger than PIPE_BUF and written with a
+ * single write(), so a reader always sees whole messages.
+ *
+ * Requests carry the password including its terminator, replies carry a
+ * single bool. Cancels and the ready message sent once the backend has
+ * warmed up have no payload.
+ *
+ * While a request is checked, the backend may send prompts and info
+ * messages for it, both carrying a string. Each prompt is answered by a
+ * response, which is sent like a request under the id of the request.
+ */
+
+enum comm_message_type {
+	COMM_MSG_REQUEST = 1,
+	COMM_MSG_CANCEL,
+	COMM_MSG_REPLY,
+	COMM_MSG_READY,
+	COMM_MSG_PROMPT,
+	COMM_MSG_INFO,
+	COMM_MSG_RESPONSE,
+};
+
+struct comm_header {
+	uint32_t type;
+	uint32_t id;
+	uint32_t len;
+};
+
 static int comm[2][2] = {{-1, -1}, {-1, -1}};
 
-ssize_t read_comm_request(char **buf_ptr) {
-	size_t size;
+// Parent side: the request whose reply is still awaited, 0 if none
+static uint32_t last_request_id = 0;
+static uint32_t pending_request_id = 0;
+
+// Child side: the request being handled
+static uint32_t current_request_id = 0;
+// A request that came in while waiting for a response to a prompt, to be
+// returned by the next read_comm_request
+static char *stashed_buf = NULL;
+static struct comm_header stashed_request;
+
+static bool read_full(int fd, void *data, size_t size) {
+	char *ptr = data;
+	while (size > 0) {
+		ssize_t amt = read(fd, ptr, size);
+		if (amt < 0 && errno == EINTR) {
+			continue;
+		} else if (amt <= 0) {
+			return false;
+		}
+		ptr += amt;
+		size -= amt;
+	}
+	return true;
+}
+
+static bool write_message(int fd, const void *data, size_t size) {
 	ssize_t amt;
-	amt = read(comm[0][0], &size, sizeof(size));
+	do {
+		amt = write(fd, data, size);
+	} while (amt < 0 && errno == EINTR);
+	return amt == (ssize_t)size;
+}
+
+// Reads one message from the UI, its payload goes to locked memory. Returns
+// 0 on EOF, -1 on errors.
+static int read_request_message(struct comm_header *header, char **buf_ptr) {
+	ssize_t amt;
+	do {
+		amt = read(comm[0][0], header, sizeof(*header));
+	} while (amt < 0 && errno == EINTR);
 	if (amt == 0) {
 		return 0;
-	} else if (amt < 0) {
+	} else if (amt != sizeof(*header)) {
 		swaylock_log_errno(LOG_ERROR, "read pw request");
 		return -1;
 	}
-	swaylock_log(LOG_DEBUG, "received pw check request");
-	char *buf = password_buffer_create(size);
+
+	*buf_ptr = NULL;
+	if (header->len == 0) {
+		if (header->type == COMM_MSG_REQUEST ||
+				header->type == COMM_MSG_RESPONSE) {
+			swaylock_log(LOG_ERROR, "received empty pw request");
+			return -1;
+		}
+		return 1;
+	}
+	char *buf = password_buffer_create(header->len);
 	if (!buf) {
 		return -1;
 	}
-	size_t offs = 0;
-	do {
-		amt = read(comm[0][0], &buf[offs], size - offs);
-		if (amt <= 0) {
-			swaylock_log_errno(LOG_ERROR, "failed to read pw");
-			return -1;
+	if (!read_full(comm[0][0], buf, header->len)) {
+		swaylock_log_errno(LOG_ERROR, "failed to read pw");
+		password_buffer_destroy(buf, header->len);
+		return -1;
+	}
+	*buf_ptr = buf;
+	return 1;
+}
+
+static bool request_pending(void) {
+	struct pollfd pfd = { .fd = comm[0][0], .events = POLLIN };
+	return poll(&pfd, 1, 0) > 0;
+}
+
+ssize_t read_comm_request(char **buf_ptr) {
+	char *buf = NULL;
+	struct comm_header request = {0};
+	if (stashed_buf) {
+		buf = stashed_buf;
+		request = stashed_request;
+		stashed_buf = NULL;
+	}
+
+	// Block for the first message, then take everything queued up while
+	// the previous request was handled: only the newest request that was
+	// not cancelled is worth checking.
+	while (!buf || request_pending()) {
+		struct comm_header header;
+		char *msg_buf;
+		int ret = read_request_message(&header, &msg_buf);
+		if (ret <= 0) {
+			if (buf) {
+				password_buffer_destroy(buf, request.len);
+			}
+			return ret;
 		}
-		offs += (size_t)amt;
-	} while (offs < size);
 
+		if (header.type == COMM_MSG_REQUEST) {
+			if (buf) {
+				swaylock_log(LOG_DEBUG, "pw request %u superseded by %u",
+					request.id, header.id);
+				password_buffer_destroy(buf, request.len);
+			}
+			buf = msg_buf;
+			request = header;
+			continue;
+		}
+		// Responses to prompts that were given up on end up here as well
+		if (msg_buf) {
+			password_buffer_destroy(msg_buf, header.len);
+		}
+		if (header.type == COMM_MSG_CANCEL && buf &&
+				header.id == request.id) {
+			swaylock_log(LOG_DEBUG, "pw request %u cancelled", request.id);
+			password_buffer_destroy(buf, request.len);
+			buf = NULL;
+		}
+	}
+
+	swaylock_log(LOG_DEBUG, "received pw check request %u", request.id);
+	current_request_id = request.id;
 	*buf_ptr = buf;
-	return size;
+	return request.len;
 }
 
 bool write_comm_reply(bool success) {
-	if (write(comm[1][1], &success, sizeof(success)) != sizeof(success)) {
+	struct comm_header header = {
+		.type = COMM_MSG_REPLY,
+		.id = current_request_id,
+		.len = sizeof(success),
+	};
+	char msg[sizeof(header) + sizeof(success)];
+	memcpy(msg, &header, sizeof(header));
+	memcpy(msg + sizeof(header), &success, sizeof(success));
+	if (!write_message(comm[1][1], msg, sizeof(msg))) {
 		swaylock_log_errno(LOG_ERROR, "failed to write pw check result");
 		return false;
 	}
 	return true;
 }
 
+static bool write_text_message(enum comm_message_type type, const char *text) {
+	char msg[PIPE_BUF];
+	struct comm_header header = {
+		.type = type,
+		.id = current_request_id,
+		.len = strlen(text) + 1,
+	};
+	if (header.len > sizeof(msg) - sizeof(header)) {
+		header.len = sizeof(msg) - sizeof(header);
+	}
+	memcpy(msg, &header, sizeof(header));
+	memcpy(msg + sizeof(header), text, header.len - 1);
+	msg[sizeof(header) + header.len - 1] = '\0';
+	if (!write_message(comm[1][1], msg, sizeof(header) + header.len)) {
+		swaylock_log_errno(LOG_ERROR, "failed to write pw backend message");
+		return false;
+	}
+	return true;
+}
+
+ssize_t read_comm_response(const char *prompt, char **buf_ptr) {
+	if (!write_text_message(COMM_MSG_PROMPT, prompt)) {
+		return -1;
+	}
+	while (1) {
+		struct comm_header header;
+		char *buf;
+		int ret = read_request_message(&header, &buf);
+		if (ret <= 0) {
+			return ret;
+		}
+		if (header.type == COMM_MSG_RESPONSE &&
+				header.id == current_request_id) {
+			*buf_ptr = buf;
+			return header.len;
+		} else if (header.type == COMM_MSG_REQUEST) {
+			// The UI moved on to a new attempt
+			if (stashed_buf) {
+				password_buffer_destroy(stashed_buf, stashed_request.len);
+			}
+			stashed_buf = buf;
+			stashed_request = header;
+			return 0;
+		}
+		if (buf) {
+			password_buffer_destroy(buf, header.len);
+		}
+		if (header.type == COMM_MSG_CANCEL &&
+				header.id == current_request_id) {
+			return 0;
+		}
+	}
+}
+
+bool write_comm_info(const char *text) {
+	return write_text_message(COMM_MSG_INFO, text);
+}
+
+bool write_comm_ready(void) {
+	struct comm_header header = { .type = COMM_MSG_READY };
+	if (!write_message(comm[1][1], &header, sizeof(header))) {
+		swaylock_log_errno(LOG_ERROR, "failed to write pw backend ready");
+		return false;
+	}
+	return true;
+}
+
 bool spawn_comm_child(void) {
 	if (pipe(comm[0]) != 0) {
 		swaylock_log_errno(LOG_ERROR, "failed to create pipe");
@@ -66,40 +276,158 @@ bool spawn_comm_child(void) {
 	}
 	close(comm[0][0]);
 	close(comm[1][1]);
+
+	// Writing to the child once it has exited must not kill the UI, the
+	// write fails with EPIPE instead
+	struct sigaction sa = { .sa_handler = SIG_IGN };
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGPIPE, &sa, NULL) != 0) {
+		swaylock_log_errno(LOG_ERROR, "failed to ignore SIGPIPE");
+		return false;
+	}
+
+	// The UI must never wait on the child
+	if (fcntl(comm[0][1], F_SETFL, O_NONBLOCK) != 0 ||
+			fcntl(comm[1][0], F_SETFL, O_NONBLOCK) != 0) {
+		swaylock_log_errno(LOG_ERROR, "failed to make pipes non-blocking");
+		return false;
+	}
 	return true;
 }
 
-bool write_comm_request(struct swaylock_password *pw) {
-	bool result = false;
-
+static bool write_password_message(enum comm_message_type type, uint32_t id,
+		struct swaylock_password *pw) {
 	size_t len = pw->len + 1;
-	size_t offs = 0;
-	if (write(comm[0][1], &len, sizeof(len)) < 0) {
-		swaylock_log_errno(LOG_ERROR, "Failed to request pw check");
-		goto out;
+	size_t size = sizeof(struct comm_header) + len;
+	if (size > PIPE_BUF) {
+		swaylock_log(LOG_ERROR, "Password too long to request pw check");
+		return false;
 	}
 
-	do {
-		ssize_t amt = write(comm[0][1], &pw->buffer[offs], len - offs);
-		if (amt < 0) {
-			swaylock_log_errno(LOG_ERROR, "Failed to write pw buffer");
-			goto out;
-		}
-		offs += amt;
-	} while (offs < len);
+	// The message holds the password, so it is built in locked memory
+	char *msg = password_buffer_create(size);
+	if (!msg) {
+		return false;
+	}
+	struct comm_header header = {
+		.type = type,
+		.id = id,
+		.len = len,
+	};
+	memcpy(msg, &header, sizeof(header));
+	memcpy(msg + sizeof(header), pw->buffer, len);
+	bool result = write_message(comm[0][1], msg, size);
+	if (!result && errno == EAGAIN) {
+		swaylock_log(LOG_ERROR, "Authentication backend is not keeping up, "
+			"dropping pw check request");
+	} else if (!result && errno == EPIPE) {
+		swaylock_log(LOG_ERROR, "Authentication backend exited, "
+			"dropping pw check request");
+	} else if (!result) {
+		swaylock_log_errno(LOG_ERROR, "Failed to request pw check");
+	}
+	password_buffer_destroy(msg, size);
+	return result;
+}
 
-	result = true;
+bool write_comm_request(struct swaylock_password *pw) {
+	uint32_t id = ++last_request_id;
+	if (id == 0) {
+		id = ++last_request_id;
+	}
+	bool result = write_password_message(COMM_MSG_REQUEST, id, pw);
+	if (result) {
+		// A reply to an older request is stale from now on
+		pending_request_id = id;
+	}
+	clear_password_buffer(pw);
+	return result;
+}
 
-out:
+bool write_comm_response(struct swaylock_password *pw) {
+	bool result = pending_request_id != 0 &&
+		write_password_message(COMM_MSG_RESPONSE, pending_request_id, pw);
 	clear_password_buffer(pw);
 	return result;
 }
 
-bool read_comm_reply(void) {
-	bool result = false;
-	if (read(comm[1][0], &result, sizeof(result)) != sizeof(result)) {
-		swaylock_log_errno(LOG_ERROR, "Failed to read pw result");
-		result = false;
+void cancel_comm_request(void) {
+	if (pending_request_id == 0) {
+		return;
+	}
+	struct comm_header header = {
+		.type = COMM_MSG_CANCEL,
+		.id = pending_request_id,
+	};
+	// The child may still be busy with the request, but it won't check
+	// the password if it hasn't started yet
+	if (!write_message(comm[0][1], &header, sizeof(header))) {
+		if (errno == EPIPE) {
+			swaylock_log(LOG_ERROR, "Authentication backend exited, "
+				"can't cancel pw check");
+		} else {
+			swaylock_log_errno(LOG_DEBUG, "Failed to cancel pw check");
+		}
+	}
+	pending_request_id = 0;
+}
+
+enum comm_reply read_comm_reply(char **text) {
+	enum comm_reply result = COMM_REPLY_NONE;
+	while (result == COMM_REPLY_NONE) {
+		struct comm_header header;
+		ssize_t amt = read(comm[1][0], &header, sizeof(header));
+		if (amt < 0 && errno == EINTR) {
+			continue;
+		} else if (amt < 0 && errno == EAGAIN) {
+			break;
+		} else if (amt == 0) {
+			swaylock_log(LOG_ERROR, "Authentication backend exited");
+			return COMM_REPLY_CLOSED;
+		}
+		// Messages are written whole, so the payload is already there
+		char payload[PIPE_BUF];
+		if (amt != sizeof(header) || header.len > sizeof(payload) ||
+				!read_full(comm[1][0], payload, header.len)) {
+			swaylock_log_errno(LOG_ERROR, "Failed to read pw result");
+			return COMM_REPLY_CLOSED;
+		}
+
+		switch (header.type) {
+		case COMM_MSG_READY:
+			result = COMM_REPLY_READY;
+			break;
+		case COMM_MSG_PROMPT:
+		case COMM_MSG_INFO:
+			if (header.id != pending_request_id || header.len == 0) {
+				break;
+			}
+			payload[header.len - 1] = '\0';
+			*text = strdup(payload);
+			if (!*text) {
+				swaylock_log(LOG_ERROR, "Allocation failed");
+				break;
+			}
+			result = header.type == COMM_MSG_PROMPT ?
+				COMM_REPLY_PROMPT : COMM_REPLY_INFO;
+			break;
+		case COMM_MSG_REPLY:
+			if (header.id != pending_request_id ||
+					header.len != sizeof(bool)) {
+				swaylock_log(LOG_DEBUG, "Ignoring stale reply to "
+					"pw request %u", header.id);
+				break;
+			}
+			pending_request_id = 0;
+			bool success;
+			memcpy(&success, payload, sizeof(success));
+			result = success ? COMM_REPLY_SUCCESS : COMM_REPLY_FAILURE;
+			break;
+		default:
+			swaylock_log(LOG_ERROR, "Unknown message %u from pw backend",
+				header.type);
+			break;
+		}
 	}
 	return result;
 }
@@ -0,0 +1,267 @@
+#define _POSIX_C_SOURCE 200809L
+#include <drm_fourcc.h>
+#include <fcntl.h>
+#include <gbm.h>
+#include <linux/dma-buf.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <wayland-client.h>
+#include "dmabuf.h"
+#include "log.h"
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
+
+struct dmabuf_format {
+	uint32_t shm_format;
+	uint32_t drm_format;
+	// Modifiers the compositor accepts the format with
+	bool linear, implicit;
+};
+
+struct dmabuf_buffer {
+	struct gbm_bo *bo;
+	int fd;
+	void *data;
+	size_t size;
+};
+
+static struct {
+	struct wl_display *display;
+	struct zwp_linux_dmabuf_v1 *dmabuf;
+	int drm_fd;
+	struct gbm_device *gbm;
+	bool no_device; // no render node could be opened
+	struct dmabuf_format formats[2];
+} dmabuf = {
+	.drm_fd = -1,
+	.formats = {
+		{ WL_SHM_FORMAT_ARGB8888, DRM_FORMAT_ARGB8888, false, false },
+		{ WL_SHM_FORMAT_XRGB8888, DRM_FORMAT_XRGB8888, false, false },
+	},
+};
+
+static void handle_format(void *data, struct zwp_linux_dmabuf_v1 *zwp_dmabuf,
+		uint32_t format) {
+	// Deprecated, modifier events are sent for each format as well
+}
+
+static void handle_modifier(void *data, struct zwp_linux_dmabuf_v1 *zwp_dmabuf,
+		uint32_t format, uint32_t modifier_hi, uint32_t modifier_lo) {
+	uint64_t modifier = ((uint64_t)modifier_hi << 32) | modifier_lo;
+	for (size_t i = 0; i < sizeof(dmabuf.formats) / sizeof(dmabuf.formats[0]); ++i) {
+		if (dmabuf.formats[i].drm_format != format) {
+			continue;
+		}
+		if (modifier == DRM_FORMAT_MOD_LINEAR) {
+			dmabuf.formats[i].linear = true;
+		} else if (modifier == DRM_FORMAT_MOD_INVALID) {
+			dmabuf.formats[i].implicit = true;
+		}
+	}
+}
+
+static const struct zwp_linux_dmabuf_v1_listener dmabuf_listener = {
+	.format = handle_format,
+	.modifier = handle_modifier,
+};
+
+void dmabuf_init(struct wl_display *display,
+		struct zwp_linux_dmabuf_v1 *zwp_dmabuf) {
+	dmabuf.display = display;
+	dmabuf.dmabuf = zwp_dmabuf;
+	zwp_linux_dmabuf_v1_add_listener(zwp_dmabuf, &dmabuf_listener, NULL);
+}
+
+static bool open_device(void) {
+	if (dmabuf.gbm) {
+		return true;
+	}
+	if (dmabuf.no_device) {
+		return false;
+	}
+
+	// Without linux-dmabuf feedback the compositor doesn't say which GPU it
+	// renders with, the first render node will do on most machines
+	for (int minor = 128; minor < 192; ++minor) {
+		char path[32];
+		snprintf(path, sizeof(path), "/dev/dri/renderD%d", minor);
+		int fd = open(path, O_RDWR | O_CLOEXEC);
+		if (fd == -1) {
+			continue;
+		}
+		struct gbm_device *gbm = gbm_create_device(fd);
+		if (!gbm) {
+			close(fd);
+			continue;
+		}
+		swaylock_log(LOG_DEBUG, "Allocating dmabuf buffers on %s", path);
+		dmabuf.drm_fd = fd;
+		dmabuf.gbm = gbm;
+		return true;
+	}
+
+	swaylock_log(LOG_ERROR, "No usable DRM render node, "
+		"falling back to shared memory buffers");
+	dmabuf.no_device = true;
+	return false;
+}
+
+static const struct dmabuf_format *get_format(uint32_t shm_format) {
+	for (size_t i = 0; i < sizeof(dmabuf.formats) / sizeof(dmabuf.formats[0]); ++i) {
+		const struct dmabuf_format *format = &dmabuf.formats[i];
+		if (format->shm_format == shm_format &&
+				(format->linear || format->implicit)) {
+			return format;
+		}
+	}
+	return NULL;
+}
+
+struct import_result {
+	bool done;
+	struct wl_buffer *buffer;
+};
+
+static void params_handle_created(void *data,
+		struct zwp_linux_buffer_params_v1 *params, struct wl_buffer *buffer) {
+	struct import_result *result = data;
+	result->buffer = buffer;
+	result->done = true;
+}
+
+static void params_handle_failed(void *data,
+		struct zwp_linux_buffer_params_v1 *params) {
+	struct import_result *result = data;
+	result->done = true;
+}
+
+static const struct zwp_linux_buffer_params_v1_listener params_listener = {
+	.created = params_handle_created,
+	.failed = params_handle_failed,
+};
+
+// Imports the buffer into the compositor. The reply is waited for on a queue
+// of its own, so no other events are dispatched in the meantime, and the
+// compositor can refuse the buffer without that being a protocol error.
+static struct wl_buffer *import_buffer(int fd, int32_t width, int32_t height,
+		uint32_t stride, const struct dmabuf_format *format) {
+	uint64_t modifier = format->linear ?
+		DRM_FORMAT_MOD_LINEAR : DRM_FORMAT_MOD_INVALID;
+
+	struct wl_event_queue *queue = wl_display_create_queue(dmabuf.display);
+	struct zwp_linux_dmabuf_v1 *wrapper = wl_proxy_create_wrapper(dmabuf.dmabuf);
+	wl_proxy_set_queue((struct wl_proxy *)wrapper, queue);
+
+	struct import_result result = {0};
+	struct zwp_linux_buffer_params_v1 *params =
+		zwp_linux_dmabuf_v1_create_params(wrapper);
+	zwp_linux_buffer_params_v1_add_listener(params, &params_listener, &result);
+	zwp_linux_buffer_params_v1_add(params, fd, 0, 0, stride,
+		modifier >> 32, modifier & 0xffffffff);
+	zwp_linux_buffer_params_v1_create(params, width, height,
+		format->drm_format, 0);
+	while (!result.done) {
+		if (wl_display_roundtrip_queue(dmabuf.display, queue) == -1) {
+			break;
+		}
+	}
+	zwp_linux_buffer_params_v1_destroy(params);
+	wl_proxy_wrapper_destroy(wrapper);
+
+	if (result.buffer) {
+		// Release events are handled along with everything else
+		wl_proxy_set_queue((struct wl_proxy *)result.buffer, NULL);
+	}
+	wl_event_queue_destroy(queue);
+	return result.buffer;
+}
+
+static void sync_access(struct dmabuf_buffer *buffer, uint64_t flags) {
+	struct dma_buf_sync sync = { .flags = flags };
+	if (ioctl(buffer->fd, DMA_BUF_IOCTL_SYNC, &sync) == -1) {
+		swaylock_log_errno(LOG_DEBUG, "Failed to sync dmabuf access");
+	}
+}
+
+struct dmabuf_buffer *dmabuf_buffer_create(int32_t width, int32_t height,
+		uint32_t shm_format, struct wl_buffer **wl_buffer, void **data,
+		uint32_t *stride) {
+	if (!dmabuf.dmabuf) {
+		return NULL;
+	}
+	const struct dmabuf_format *format = get_format(shm_format);
+	if (!format || !open_device()) {
+		return NULL;
+	}
+
+	struct dmabuf_buffer *buffer = calloc(1, sizeof(*buffer));
+	if (!buffer) {
+		return NULL;
+	}
+	buffer->fd = -1;
+
+	// Linear, so cairo can draw into the mapping
+	buffer->bo = gbm_bo_create(dmabuf.gbm, width, height, format->drm_format,
+		GBM_BO_USE_LINEAR | GBM_BO_USE_RENDERING);
+	if (!buffer->bo) {
+		swaylock_log(LOG_DEBUG, "Failed to allocate a %dx%d dmabuf",
+			width, height);
+		goto error;
+	}
+	buffer->fd = gbm_bo_get_fd(buffer->bo);
+	if (buffer->fd == -1) {
+		goto error;
+	}
+	*stride = gbm_bo_get_stride(buffer->bo);
+	buffer->size = (size_t)*stride * height;
+	buffer->data = mmap(NULL, buffer->size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, buffer->fd, 0);
+	if (buffer->data == MAP_FAILED) {
+		swaylock_log_errno(LOG_DEBUG, "Failed to map dmabuf");
+		buffer->data = NULL;
+		goto error;
+	}
+
+	*wl_buffer = import_buffer(buffer->fd, width, height, *stride, format);
+	if (!*wl_buffer) {
+		swaylock_log(LOG_DEBUG, "Compositor refused a %dx%d dmabuf",
+			width, height);
+		goto error;
+	}
+
+	sync_access(buffer, DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW);
+	*data = buffer->data;
+	return buffer;
+
+error:
+	dmabuf_buffer_destroy(buffer);
+	return NULL;
+}
+
+void dmabuf_buffer_finish(struct dmabuf_buffer *buffer) {
+	sync_access(buffer, DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW);
+}
+
+void dmabuf_buffer_begin_read(struct dmabuf_buffer *buffer) {
+	sync_access(buffer, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+}
+
+void dmabuf_buffer_end_read(struct dmabuf_buffer *buffer) {
+	sync_access(buffer, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+}
+
+void dmabuf_buffer_destroy(struct dmabuf_buffer *buffer) {
+	if (buffer->data) {
+		munmap(buffer->data, buffer->size);
+	}
+	if (buffer->fd != -1) {
+		close(buffer->fd);
+	}
+	if (buffer->bo) {
+		gbm_bo_destroy(buffer->bo);
+	}
+	free(buffer);
+}
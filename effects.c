@@ -0,0 +1,330 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "effects.h"
+#include "log.h"
+
+/*
+ * Effects work on the premultiplied pixels of the buffer in place, on the
+ * worker rendering the background. Backgrounds of different outputs are
+ * rendered on workers of their own already. The inner loops are kept simple
+ * enough for the compiler to vectorize them.
+ */
+
+struct image {
+	uint8_t *data;
+	int width, height, stride;
+};
+
+struct pass {
+	void (*run)(const struct pass *pass, int first, int last);
+	const struct effect *effect;
+	struct image in, out; // the same image for effects done in place
+};
+
+// Runs the pass over all rows
+static void run_pass(const struct pass *pass) {
+	pass->run(pass, 0, pass->out.height);
+}
+
+static inline int clamp_index(int i, int size) {
+	return i < 0 ? 0 : i >= size ? size - 1 : i;
+}
+
+// Fixed point factor dividing the sum of a box blur window by its size
+static uint32_t box_factor(int radius) {
+	return 65536 / (2 * radius + 1);
+}
+
+// Writes the average of the window, then slides it on by a pixel
+static inline void blur_step(uint32_t *sum, uint32_t factor,
+		uint8_t *out, const uint8_t *add, const uint8_t *sub) {
+	for (int c = 0; c < 4; ++c) {
+		out[c] = (sum[c] * factor + 32768) >> 16;
+		sum[c] += add[c] - sub[c];
+	}
+}
+
+static void blur_rows(const struct pass *pass, int first, int last) {
+	int radius = pass->effect->blur.radius;
+	int width = pass->in.width;
+	uint32_t factor = box_factor(radius);
+	for (int y = first; y < last; ++y) {
+		const uint8_t *in = pass->in.data + (size_t)y * pass->in.stride;
+		uint8_t *out = pass->out.data + (size_t)y * pass->out.stride;
+		uint32_t sum[4] = { 0 };
+		for (int x = -radius; x <= radius; ++x) {
+			const uint8_t *pixel = &in[clamp_index(x, width) * 4];
+			for (int c = 0; c < 4; ++c) {
+				sum[c] += pixel[c];
+			}
+		}
+		// Only the ends of the row need clamping
+		int x = 0;
+		int start = radius < width ? radius : width;
+		int end = width - radius - 1 > start ? width - radius - 1 : start;
+		for (; x < start; ++x) {
+			blur_step(sum, factor, &out[x * 4],
+				&in[clamp_index(x + radius + 1, width) * 4], &in[0]);
+		}
+		for (; x < end; ++x) {
+			blur_step(sum, factor, &out[x * 4],
+				&in[(x + radius + 1) * 4], &in[(x - radius) * 4]);
+		}
+		for (; x < width; ++x) {
+			blur_step(sum, factor, &out[x * 4], &in[(width - 1) * 4],
+				&in[clamp_index(x - radius, width) * 4]);
+		}
+	}
+}
+
+static void blur_columns(const struct pass *pass, int first, int last) {
+	int radius = pass->effect->blur.radius;
+	int height = pass->in.height;
+	uint32_t factor = box_factor(radius);
+	size_t bytes = (size_t)pass->in.width * 4;
+	uint32_t *sum = calloc(bytes, sizeof(*sum));
+	if (!sum) {
+		swaylock_log(LOG_ERROR, "Failed to allocate blur buffer");
+		return;
+	}
+
+	for (int y = first - radius; y <= first + radius; ++y) {
+		const uint8_t *in = pass->in.data +
+			(size_t)clamp_index(y, height) * pass->in.stride;
+		for (size_t i = 0; i < bytes; ++i) {
+			sum[i] += in[i];
+		}
+	}
+	for (int y = first; y < last; ++y) {
+		uint8_t *out = pass->out.data + (size_t)y * pass->out.stride;
+		const uint8_t *add = pass->in.data +
+			(size_t)clamp_index(y + radius + 1, height) * pass->in.stride;
+		const uint8_t *sub = pass->in.data +
+			(size_t)clamp_index(y - radius, height) * pass->in.stride;
+		for (size_t i = 0; i < bytes; ++i) {
+			out[i] = (sum[i] * factor + 32768) >> 16;
+			sum[i] += add[i] - sub[i];
+		}
+	}
+	free(sum);
+}
+
+static void pixelate_rows(const struct pass *pass, int first, int last) {
+	const struct image *image = &pass->out;
+	int size = pass->effect->pixelate;
+	for (int y0 = first; y0 < last; y0 += size) {
+		int y1 = y0 + size < image->height ? y0 + size : image->height;
+		for (int x0 = 0; x0 < image->width; x0 += size) {
+			int x1 = x0 + size < image->width ? x0 + size : image->width;
+			uint64_t sum[4] = { 0 };
+			for (int y = y0; y < y1; ++y) {
+				const uint8_t *row = image->data + (size_t)y * image->stride;
+				for (int x = x0 * 4; x < x1 * 4; x += 4) {
+					for (int c = 0; c < 4; ++c) {
+						sum[c] += row[x + c];
+					}
+				}
+			}
+
+			uint64_t count = (uint64_t)(y1 - y0) * (x1 - x0);
+			uint8_t average[4];
+			for (int c = 0; c < 4; ++c) {
+				average[c] = (sum[c] + count / 2) / count;
+			}
+			for (int y = y0; y < y1; ++y) {
+				uint8_t *row = image->data + (size_t)y * image->stride;
+				for (int x = x0; x < x1; ++x) {
+					memcpy(&row[x * 4], average, sizeof(average));
+				}
+			}
+		}
+	}
+}
+
+// Multiplies the color channels by factor / 256, leaving alpha as is
+static inline uint32_t shade_pixel(uint32_t pixel, uint32_t factor) {
+	uint32_t rb = ((pixel & 0xff00ff) * factor >> 8) & 0xff00ff;
+	uint32_t g = ((pixel & 0x00ff00) * factor >> 8) & 0x00ff00;
+	return (pixel & 0xff000000) | rb | g;
+}
+
+static void dim_rows(const struct pass *pass, int first, int last) {
+	const struct image *image = &pass->out;
+	uint32_t factor = (1 - pass->effect->dim) * 256 + 0.5;
+	for (int y = first; y < last; ++y) {
+		uint32_t *row = (uint32_t *)(image->data + (size_t)y * image->stride);
+		for (int x = 0; x < image->width; ++x) {
+			row[x] = shade_pixel(row[x], factor);
+		}
+	}
+}
+
+static void vignette_rows(const struct pass *pass, int first, int last) {
+	const struct image *image = &pass->out;
+	double base = pass->effect->vignette.base;
+	double strength = pass->effect->vignette.factor;
+	for (int y = first; y < last; ++y) {
+		uint32_t *row = (uint32_t *)(image->data + (size_t)y * image->stride);
+		float fy = (y + 0.5f) / image->height;
+		// Reaches 1 in the center and 0 at the edges
+		float weight_y = 4 * fy * (1 - fy);
+		for (int x = 0; x < image->width; ++x) {
+			float fx = (x + 0.5f) / image->width;
+			float brightness = base + strength * 4 * fx * (1 - fx) * weight_y;
+			brightness = brightness < 0 ? 0 : brightness > 1 ? 1 : brightness;
+			row[x] = shade_pixel(row[x], brightness * 256 + 0.5f);
+		}
+	}
+}
+
+static bool parse_number(const char *arg, char **end, double *value,
+		double min, double max) {
+	errno = 0;
+	*value = strtod(arg, end);
+	return errno == 0 && *end != arg && *value >= min && *value <= max;
+}
+
+bool parse_effect(enum effect_type type, const char *arg,
+		struct effect *effect) {
+	*effect = (struct effect){ .type = type };
+	char *end = NULL;
+	double value;
+	bool valid = false;
+	switch (type) {
+	case EFFECT_BLUR:
+		effect->blur.passes = 3;
+		// Larger radii would make box_factor too imprecise
+		valid = parse_number(arg, &end, &value, 1, 255);
+		effect->blur.radius = value;
+		if (valid && *end == 'x') {
+			valid = parse_number(end + 1, &end, &value, 1, 16);
+			effect->blur.passes = value;
+		}
+		break;
+	case EFFECT_PIXELATE:
+		valid = parse_number(arg, &end, &value, 1, 10000);
+		effect->pixelate = value;
+		break;
+	case EFFECT_DIM:
+		valid = parse_number(arg, &end, &effect->dim, 0, 1);
+		break;
+	case EFFECT_VIGNETTE:
+		valid = parse_number(arg, &end, &effect->vignette.base, 0, 1) &&
+			*end == ':' && parse_number(end + 1, &end,
+				&effect->vignette.factor, 0, 1);
+		break;
+	}
+	if (!valid || *end != '\0') {
+		swaylock_log(LOG_ERROR, "Invalid effect argument '%s'", arg);
+		return false;
+	}
+	return true;
+}
+
+char *describe_effects(const struct effect *effects, int count) {
+	char *description = NULL;
+	size_t size = 0;
+	FILE *stream = open_memstream(&description, &size);
+	if (!stream) {
+		return NULL;
+	}
+	for (int i = 0; i < count; ++i) {
+		const struct effect *effect = &effects[i];
+		switch (effect->type) {
+		case EFFECT_BLUR:
+			fprintf(stream, "blur %dx%d;", effect->blur.radius,
+				effect->blur.passes);
+			break;
+		case EFFECT_PIXELATE:
+			fprintf(stream, "pixelate %d;", effect->pixelate);
+			break;
+		case EFFECT_DIM:
+			fprintf(stream, "dim %g;", effect->dim);
+			break;
+		case EFFECT_VIGNETTE:
+			fprintf(stream, "vignette %g:%g;", effect->vignette.base,
+				effect->vignette.factor);
+			break;
+		}
+	}
+	if (fclose(stream) != 0) {
+		free(description);
+		return NULL;
+	}
+	return description;
+}
+
+void apply_effects(cairo_surface_t *surface, const struct effect *effects,
+		int count) {
+	if (count == 0) {
+		return;
+	}
+	cairo_format_t format = cairo_image_surface_get_format(surface);
+	if (cairo_surface_get_type(surface) != CAIRO_SURFACE_TYPE_IMAGE ||
+			(format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24)) {
+		swaylock_log(LOG_ERROR, "Effects can't be applied to this buffer");
+		return;
+	}
+
+	cairo_surface_flush(surface);
+	struct image image = {
+		.data = cairo_image_surface_get_data(surface),
+		.width = cairo_image_surface_get_width(surface),
+		.height = cairo_image_surface_get_height(surface),
+		.stride = cairo_image_surface_get_stride(surface),
+	};
+	if (image.width == 0 || image.height == 0) {
+		return;
+	}
+	// Blocks larger than the image look the same as the image itself
+	int max_size = image.width > image.height ? image.width : image.height;
+
+	struct image scratch = image;
+	scratch.data = NULL;
+	for (int i = 0; i < count; ++i) {
+		struct effect effect = effects[i];
+		struct pass pass = { .effect = &effect, .in = image, .out = image };
+		switch (effect.type) {
+		case EFFECT_BLUR:
+			if (!scratch.data) {
+				scratch.data = malloc((size_t)image.stride * image.height);
+				if (!scratch.data) {
+					swaylock_log(LOG_ERROR, "Failed to allocate blur buffer");
+					continue;
+				}
+			}
+			for (int j = 0; j < effect.blur.passes; ++j) {
+				pass.run = blur_rows;
+				pass.in = image;
+				pass.out = scratch;
+				run_pass(&pass);
+				pass.run = blur_columns;
+				pass.in = scratch;
+				pass.out = image;
+				run_pass(&pass);
+			}
+			break;
+		case EFFECT_PIXELATE:
+			if (effect.pixelate > max_size) {
+				effect.pixelate = max_size;
+			}
+			pass.run = pixelate_rows;
+			run_pass(&pass);
+			break;
+		case EFFECT_DIM:
+			pass.run = dim_rows;
+			run_pass(&pass);
+			break;
+		case EFFECT_VIGNETTE:
+			pass.run = vignette_rows;
+			run_pass(&pass);
+			break;
+		}
+	}
+	free(scratch.data);
+	cairo_surface_mark_dirty(surface);
+}
@@ -0,0 +1,42 @@
+#ifndef _SWAYLOCK_ANIMATION_H
+#define _SWAYLOCK_ANIMATION_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+// Progress of a transition that is done
+#define TRANSITION_DONE 255
+
+// A part of the indicator changing from one value to another, a color or an
+// angle. Whoever draws it decides how the two are blended.
+struct transition {
+	uint32_t from, to;
+	struct timespec start; // zero once settled on to
+};
+
+// Everything of the indicator that eases instead of snapping to the state
+struct indicator_animation {
+	struct transition opacity; // of the whole indicator, 0 or 255
+	struct transition border; // color of the inner and outer border
+	struct transition highlight_color; // of the typing highlight, 0 if hidden
+	struct transition highlight_angle; // start of the highlight, in 2048ths
+	int over_budget; // animated frames in a row that took too long
+};
+
+// Starts changing towards to, from what is shown at the moment. Transitions
+// with a duration of 0 ms settle on to right away.
+void transition_set(struct transition *transition, uint32_t from, uint32_t to,
+		const struct timespec *now, int duration_ms);
+// Eased progress from 0 to TRANSITION_DONE, in steps coarse enough for
+// frames to be compared. Settles the transition once it is done.
+uint8_t transition_progress(struct transition *transition,
+		const struct timespec *now, int duration_ms);
+
+// Blends two 0xRRGGBBAA colors, a color of 0 fading out the other one
+uint32_t blend_colors(uint32_t from, uint32_t to, uint8_t progress);
+
+// Settles all transitions of the indicator, for when drawing them is too
+// slow to keep up with the display
+void animation_finish(struct indicator_animation *animation);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef _SWAYLOCK_BACKGROUND_CACHE_H
+#define _SWAYLOCK_BACKGROUND_CACHE_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-client.h>
+#include "background-image.h"
+#include "pool-buffer.h"
+
+// Builds the key identifying a background rendered from the image at `path`,
+// with the effects described by describe_effects(). The key changes whenever
+// the image file is modified. Returns NULL if the image can't be stat'd.
+char *background_cache_key(const char *path, enum background_mode mode,
+		uint32_t color, const char *effects, int width, int height);
+
+// Whether a background for the key is stored in the cache.
+bool background_cache_contains(const char *key, int width, int height);
+
+// Creates a buffer backed directly by the cache file for the key.
+bool background_cache_load(struct wl_shm *shm, const char *key,
+		int width, int height, struct pool_buffer *buffer);
+
+// Writes the contents of the buffer to the cache. Safe to call from a
+// worker thread.
+bool background_cache_store(const char *key, const struct pool_buffer *buffer);
+
+#endif
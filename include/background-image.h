@@ -14,6 +14,11 @@ enum background_mode {
 
 enum background_mode parse_background_mode(const char *mode);
 cairo_surface_t *load_background_image(const char *path);
+// Loads an image no larger than needed to render it with the given mode into
+// buffers of at most max_width x max_height. A max size of 0 loads the image
+// at full size.
+cairo_surface_t *load_background_image_at_size(const char *path,
+		enum background_mode mode, int max_width, int max_height);
 void render_background_image(cairo_t *cairo, cairo_surface_t *image,
 		enum background_mode mode, int buffer_width, int buffer_height);
 
@@ -0,0 +1,18 @@
+#ifndef _SWAYLOCK_CLOCK_H
+#define _SWAYLOCK_CLOCK_H
+
+struct swaylock_state;
+
+// Loads the LC_TIME locale of the environment for the clock, and looks at
+// the time and date formats. The formats can't change afterwards.
+void clock_init(struct swaylock_state *state);
+void clock_finish(void);
+// Returns the time and date text, NULL for empty formats. Each is formatted
+// again only once the smallest unit it shows has changed, the strings stay
+// valid until then.
+void clock_get_text(const char **time_str, const char **date_str);
+// Redraws the clock whenever its text changes, on the next second, minute or
+// day boundary depending on what the time and date formats show.
+void schedule_clock(struct swaylock_state *state);
+
+#endif
@@ -2,16 +2,45 @@
 #define _SWAYLOCK_COMM_H
 
 #include <stdbool.h>
+#include <sys/types.h>
 
 struct swaylock_password;
 
+enum comm_reply {
+	COMM_REPLY_NONE, // nothing read, or only replies to stale requests
+	COMM_REPLY_SUCCESS,
+	COMM_REPLY_FAILURE,
+	COMM_REPLY_READY, // the backend is done warming up
+	COMM_REPLY_PROMPT, // the pending check needs another answer
+	COMM_REPLY_INFO, // a message to show for the pending check
+	COMM_REPLY_CLOSED, // the backend is gone
+};
+
 bool spawn_comm_child(void);
+// Returns the newest password to check, skipping requests that were
+// superseded or cancelled in the meantime.
 ssize_t read_comm_request(char **buf_ptr);
+// Replies to the request last returned by read_comm_request.
 bool write_comm_reply(bool success);
+// Tells the UI the backend is done with its setup and checks will be fast.
+bool write_comm_ready(void);
+// Shows the prompt for the request being checked and waits for the answer.
+// Returns 0 if the UI gave up on the request instead.
+ssize_t read_comm_response(const char *prompt, char **buf_ptr);
+// Shows a message for the request being checked.
+bool write_comm_info(const char *text);
 // Requests the provided password to be checked. The password is always cleared
-// when the function returns.
+// when the function returns. Replies to earlier requests are ignored from now
+// on.
 bool write_comm_request(struct swaylock_password *pw);
-bool read_comm_reply(void);
+// Answers a prompt of the pending request. The password is always cleared.
+bool write_comm_response(struct swaylock_password *pw);
+// Stops waiting for the pending request, and lets the backend skip it if it
+// hasn't started checking it yet.
+void cancel_comm_request(void);
+// Never blocks. For prompts and info messages, the text is returned in a
+// newly allocated string.
+enum comm_reply read_comm_reply(char **text);
 // FD to poll for password authentication replies.
 int get_comm_reply_fd(void);
 
@@ -0,0 +1,26 @@
+#ifndef _SWAYLOCK_DMABUF_H
+#define _SWAYLOCK_DMABUF_H
+#include <stdint.h>
+#include <wayland-client.h>
+
+struct zwp_linux_dmabuf_v1;
+struct dmabuf_buffer;
+
+// Makes create_buffer allocate linear GBM buffers, shared with the compositor
+// through zwp_linux_dmabuf_v1, for the formats the compositor accepts them in.
+void dmabuf_init(struct wl_display *display, struct zwp_linux_dmabuf_v1 *dmabuf);
+
+// Allocates a buffer and maps it for drawing. Returns NULL if dmabuf isn't
+// available for the format, the caller falls back to shared memory then.
+struct dmabuf_buffer *dmabuf_buffer_create(int32_t width, int32_t height,
+	uint32_t shm_format, struct wl_buffer **wl_buffer, void **data,
+	uint32_t *stride);
+// Ends CPU access to the mapping, after which the compositor may read it.
+void dmabuf_buffer_finish(struct dmabuf_buffer *buffer);
+// Bracket reading the mapping back once it is finished, the compositor may
+// be reading it at the same time.
+void dmabuf_buffer_begin_read(struct dmabuf_buffer *buffer);
+void dmabuf_buffer_end_read(struct dmabuf_buffer *buffer);
+void dmabuf_buffer_destroy(struct dmabuf_buffer *buffer);
+
+#endif
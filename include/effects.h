@@ -0,0 +1,45 @@
+#ifndef _SWAYLOCK_EFFECTS_H
+#define _SWAYLOCK_EFFECTS_H
+#include <stdbool.h>
+#include "cairo.h"
+
+enum effect_type {
+	EFFECT_BLUR,
+	EFFECT_PIXELATE,
+	EFFECT_DIM,
+	EFFECT_VIGNETTE,
+};
+
+struct effect {
+	enum effect_type type;
+	union {
+		struct {
+			int radius; // in pixels
+			int passes; // of a box blur, 3 and up approximate a Gaussian
+		} blur;
+		int pixelate; // size of the blocks in pixels
+		double dim; // 0 leaves the image as is, 1 makes it black
+		struct {
+			// Brightness at the corners, and how much brighter it gets
+			// towards the center
+			double base, factor;
+		} vignette;
+	};
+};
+
+// Parses the argument of the option for an effect of the given type:
+// <radius>[x<passes>] for blur, <size> for pixelate, <amount> for dim and
+// <base>:<factor> for vignette.
+bool parse_effect(enum effect_type type, const char *arg,
+		struct effect *effect);
+
+// Describes the effects, to tell backgrounds rendered with different ones
+// apart. Returns NULL if out of memory.
+char *describe_effects(const struct effect *effects, int count);
+
+// Applies the effects in order to an ARGB32 image surface, on the calling
+// thread.
+void apply_effects(cairo_surface_t *surface, const struct effect *effects,
+		int count);
+
+#endif
@@ -37,17 +37,28 @@ void loop_add_fd(struct loop *loop, int fd, short mask,
  * Add a timer to the loop.
  *
  * When the timer expires, the timer will be removed from the loop and freed.
+ * Timers are reused afterwards, so pointers to them must be cleared in the
+ * callback.
  */
 struct loop_timer *loop_add_timer(struct loop *loop, int ms,
 		void (*callback)(void *data), void *data);
 
+/**
+ * Add a timer which may fire up to slack_ms late.
+ *
+ * The expiry is rounded up to a multiple of the slack, so timers that
+ * expire close to each other are dispatched in a single wakeup.
+ */
+struct loop_timer *loop_add_timer_slack(struct loop *loop, int ms,
+		int slack_ms, void (*callback)(void *data), void *data);
+
 /**
  * Remove a file descriptor from the loop.
  */
 bool loop_remove_fd(struct loop *loop, int fd);
 
 /**
- * Remove a timer from the loop.
+ * Remove a timer from the loop, which frees it.
  */
 bool loop_remove_timer(struct loop *loop, struct loop_timer *timer);
 
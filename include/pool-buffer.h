@@ -5,20 +5,53 @@
 #include <stdint.h>
 #include <wayland-client.h>
 
+struct shm_arena;
+struct dmabuf_buffer;
+
 struct pool_buffer {
 	struct wl_buffer *buffer;
 	cairo_surface_t *surface;
 	cairo_t *cairo;
-	uint32_t width, height;
+	uint32_t width, height, stride;
 	void *data;
 	size_t size;
 	bool busy;
+	int users; // surfaces the buffer is attached to
+	// The arena the buffer was carved out of, if any
+	struct shm_arena *arena;
+	size_t offset;
+	struct wl_list link; // struct shm_arena::buffers
+	struct dmabuf_buffer *dmabuf; // NULL for shared memory buffers
 };
 
+// Allocates a dmabuf if enabled and supported, a shared memory buffer
+// otherwise.
 struct pool_buffer *create_buffer(struct wl_shm *shm, struct pool_buffer *buf,
 	int32_t width, int32_t height, uint32_t format);
-struct pool_buffer *get_next_buffer(struct wl_shm *shm,
-	struct pool_buffer pool[static 2], uint32_t width, uint32_t height);
+// Always allocates shared memory, for buffers the CPU reads back.
+struct pool_buffer *create_shm_buffer(struct wl_shm *shm,
+	struct pool_buffer *buf, int32_t width, int32_t height, uint32_t format);
+// Has to be called once drawing into a buffer from create_buffer is done,
+// before it is attached.
+void finish_buffer(struct pool_buffer *buffer);
+// Bracket reading the pixels of a finished buffer on the CPU. dmabufs are
+// only coherent with the device inside these. Safe to call from a worker
+// thread.
+void begin_buffer_read(const struct pool_buffer *buffer);
+void end_buffer_read(const struct pool_buffer *buffer);
+// Creates a buffer for pixels already stored in a file, at the given offset.
+// The buffer has no mapping or cairo context of its own.
+struct pool_buffer *create_buffer_from_fd(struct wl_shm *shm,
+	struct pool_buffer *buf, int fd, size_t size, int32_t offset,
+	int32_t width, int32_t height, int32_t stride, uint32_t format);
+// An arena is a single wl_shm_pool that buffers are carved out of. It grows
+// with wl_shm_pool_resize when a buffer doesn't fit, and the space of
+// destroyed buffers is reused.
+struct shm_arena *shm_arena_create(struct wl_shm *shm);
+// Buffers still allocated from the arena have to be destroyed first.
+void shm_arena_destroy(struct shm_arena *arena);
+struct pool_buffer *create_arena_buffer(struct shm_arena *arena,
+	struct pool_buffer *buf, int32_t width, int32_t height, uint32_t format);
 void destroy_buffer(struct pool_buffer *buffer);
 
 #endif
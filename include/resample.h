@@ -0,0 +1,26 @@
+#ifndef _SWAYLOCK_RESAMPLE_H
+#define _SWAYLOCK_RESAMPLE_H
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Scales an image down with a box filter and draws it over another one,
+ * both premultiplied ARGB32 in native byte order. Each destination pixel is
+ * the average of the source pixels it covers, which keeps large downscales
+ * sharp without aliasing.
+ *
+ * The source is scaled by scale_x and scale_y, both at most 1, and its top
+ * left corner put at (x, y) in the destination. It may extend past the
+ * destination on any side, and pixels it only partly covers are blended by
+ * coverage. With opaque set, the alpha bytes of the source are ignored, as
+ * for CAIRO_FORMAT_RGB24.
+ *
+ * Returns false if the scratch memory can't be allocated, in which case the
+ * destination is left untouched.
+ */
+bool resample_over(const uint32_t *src, int src_stride, int src_width,
+	int src_height, bool opaque, uint32_t *dst, int dst_stride,
+	int dst_width, int dst_height, double scale_x, double scale_y,
+	double x, double y);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef _SWAYLOCK_SCREENSHOT_H
+#define _SWAYLOCK_SCREENSHOT_H
+#include <stdbool.h>
+
+struct swaylock_surface;
+
+// Starts capturing what the output of the surface shows, as an image that
+// is then shown on that output. Captures of all outputs run at the same time.
+void screenshot_output(struct swaylock_surface *surface);
+
+// Whether any capture has yet to finish.
+bool screenshots_pending(void);
+
+// Gives up on the captures that haven't finished, their outputs show what
+// they would without --screenshots.
+void screenshots_cancel(void);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef _SWAYLOCK_STATS_H
+#define _SWAYLOCK_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+enum stats_histogram {
+	STATS_RENDER_BACKGROUND, // render_frame_background
+	STATS_RENDER_INDICATOR, // render_frame
+	STATS_KEY_TO_PRESENT, // key press until the frame showing it is done
+	STATS_HISTOGRAM_COUNT,
+};
+
+enum stats_render_path {
+	STATS_BACKGROUND_REUSED, // the committed background still fits
+	STATS_BACKGROUND_SHARED, // already rendered, for another output
+	STATS_BACKGROUND_DISK_CACHE,
+	STATS_BACKGROUND_SOLID, // single pixel buffer
+	STATS_BACKGROUND_RENDERED,
+	STATS_INDICATOR_REUSED, // already rendered, for another output
+	STATS_INDICATOR_RENDERED,
+	STATS_RENDER_PATH_COUNT,
+};
+
+// Counters are kept per output name, and outlive the outputs.
+struct output_stats;
+
+struct output_stats *stats_get_output(const char *name);
+// Adds the time since start to the histogram.
+void stats_record_time(struct output_stats *stats,
+		enum stats_histogram histogram, const struct timespec *start);
+void stats_count_path(struct output_stats *stats, enum stats_render_path path);
+void stats_count_allocation(struct output_stats *stats, size_t bytes);
+// Counts a frame that wasn't drawn, because no buffer could be had.
+void stats_count_dropped_frame(struct output_stats *stats);
+
+// Appends one JSON line per output to the file, "-" is stderr.
+bool stats_write(const char *path);
+void stats_destroy(void);
+
+#endif
@@ -2,9 +2,12 @@
 #define _SWAYLOCK_H
 #include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
 #include <wayland-client.h>
+#include "animation.h"
 #include "background-image.h"
 #include "cairo.h"
+#include "effects.h"
 #include "pool-buffer.h"
 #include "seat.h"
 
@@ -13,6 +16,7 @@ enum auth_state {
 	AUTH_STATE_IDLE, // nothing happening
 	AUTH_STATE_VALIDATING, // currently validating password
 	AUTH_STATE_INVALID, // displaying message: password was wrong
+	AUTH_STATE_PROMPT, // waiting for the answer to a prompt of the check
 };
 
 // Indicator state: status of password buffer / typing letters
@@ -43,6 +47,12 @@ struct swaylock_colors {
 };
 
 struct swaylock_args {
+	// general
+	int timer_slack; // ms the idle and clock timers may fire late
+	int auth_timeout; // seconds until a password check is given up, or 0
+	char *trace_path; // where to write startup timings, if anywhere
+	char *stats_path; // where to write frame stats on exit, if anywhere
+
 	// input & indicator
 	bool ignore_empty;
 	bool show_indicator;
@@ -51,9 +61,19 @@ struct swaylock_args {
 	uint32_t thickness;
 	int32_t indicator_x_position;
 	int32_t indicator_y_position;
+	int indicator_buffers; // buffers kept per indicator group
+	int animation_duration; // ms the indicator takes to change, 0 to snap
+	int animation_budget; // us an animated frame may take, 0 for no limit
 	
 	// background image mode	
 	enum background_mode mode;
+	bool downscale_images; // decode images at the size of the outputs
+	bool cache_backgrounds; // keep rendered backgrounds on disk
+	bool dmabuf; // allocate backgrounds as dmabufs
+	bool compositor_scaling; // let the compositor scale up small images
+	bool screenshots; // show what the outputs showed before locking
+	struct effect *effects; // applied to background images, in order
+	int effects_count;
 
 	// font
 	char *font;
@@ -76,31 +96,74 @@ struct swaylock_password {
 
 struct swaylock_state {
 	struct loop *eventloop;
+	struct worker_pool *workers; // decodes and caches background images
+	struct loop_timer *clock_timer; // fires when the clock text changes
 	struct loop_timer *input_idle_timer; // timer to reset input state to IDLE
 	struct loop_timer *auth_idle_timer; // timer to stop displaying AUTH_STATE_INVALID
+	struct loop_timer *auth_timeout_timer; // gives up on a password check
 	struct loop_timer *clear_password_timer;  // clears the password buffer
 	struct wl_display *display;
 	struct wl_compositor *compositor;
 	struct wl_subcompositor *subcompositor;
 	struct wl_shm *shm;
 	struct wl_list surfaces;
+	int max_surfaces; // most outputs seen at once, sizes the unused caches
 	struct wl_list images;
+	struct wl_list backgrounds; // struct swaylock_background::link
+	struct wl_list indicator_groups; // struct indicator_group::link
 	struct swaylock_args args;
 	struct swaylock_password password;
 	struct swaylock_xkb xkb;
-	cairo_surface_t *test_surface;
-	cairo_t *test_cairo; // used to estimate font/text sizes
+	struct wl_list fonts; // struct swaylock_font::link
 	enum auth_state auth_state; // state of the authentication attempt
 	enum input_state input_state; // state of the password buffer and key inputs
+	bool auth_ready; // the backend is done with its setup
+	char *auth_prompt; // prompt of the check, for AUTH_STATE_PROMPT
+	char *auth_message; // last message from the check, if any
 	uint32_t highlight_start; // position of highlight; 2048 = 1 full turn
+	bool highlight_pending; // move the highlight on the next flush
+	struct indicator_animation animation;
+	struct timespec key_time; // first key press not drawn yet, or zero
+	bool damaged; // surfaces are damaged on the next flush
 	int failed_attempts;
 	bool run_display, locked;
 	struct ext_session_lock_manager_v1 *ext_session_lock_manager_v1;
+	// Both optional, for --screenshots
+	struct ext_output_image_capture_source_manager_v1 *output_capture_source_manager;
+	struct ext_image_copy_capture_manager_v1 *image_copy_capture_manager;
 	struct ext_session_lock_v1 *ext_session_lock_v1;
+	struct wp_viewporter *viewporter; // optional, for solid colors
+	struct wp_single_pixel_buffer_manager_v1 *single_pixel_buffer_manager;
+	struct wp_fractional_scale_manager_v1 *fractional_scale_manager;
 };
 
+// What went into one of the indicator buffers, so the next frame can tell
+// whether only the clock text has changed since
+struct indicator_frame {
+	bool valid;
+	bool draw_indicator;
+	enum auth_state auth_state;
+	bool auth_ready;
+	enum input_state input_state;
+	// Where the animation was at, eased from the state above
+	uint8_t opacity;
+	uint32_t border_from, border_to;
+	uint8_t border_progress;
+	uint32_t highlight_color; // 0 if no highlight is shown
+	uint32_t highlight_start;
+	bool animating; // later frames will look different
+	enum wl_output_subpixel subpixel;
+	double scale;
+	int width, height;
+	uint32_t text_serial; // changes along with the clock text
+	cairo_rectangle_int_t text; // bounds of the clock text, in buffer pixels
+};
+
+struct indicator_group;
+struct output_stats;
+
 struct swaylock_surface {
-	cairo_surface_t *image;
+	struct swaylock_image *image;
 	struct swaylock_state *state;
 	struct wl_output *output;
 	uint32_t output_global_name;
@@ -108,34 +171,98 @@ struct swaylock_surface {
 	struct wl_surface *child; // indicator surface made into subsurface
 	struct wl_subsurface *subsurface;
 	struct ext_session_lock_surface_v1 *ext_session_lock_surface_v1;
-	struct pool_buffer indicator_buffers[2];
+	struct wp_viewport *viewport; // maps background buffers onto the surface
+	struct wp_viewport *child_viewport; // same for fractionally scaled indicators
+	struct wp_fractional_scale_v1 *fractional_scale_v1;
+	// Indicator shared with the other outputs of the same scale and subpixel
+	// layout, and the buffer of it attached to the child surface
+	struct indicator_group *indicator;
+	struct pool_buffer *indicator_buffer;
+	struct indicator_frame indicator_frame; // what the child surface shows
 	bool created;
 	bool frame_pending, dirty;
 	uint32_t width, height;
 	int32_t scale;
+	uint32_t fractional_scale; // preferred scale in 120ths, 0 if not known
 	enum wl_output_subpixel subpixel;
+	enum wl_output_transform transform;
+	int32_t mode_width, mode_height; // current output mode, in pixels
 	char *output_name;
+	uint32_t traced; // enum trace_output_event already traced
+	struct output_stats *stats;
+	// First key press this surface hasn't drawn, and the one drawn in the
+	// frame waiting to be presented, or zero
+	struct timespec key_time, committed_key_time;
 	struct wl_list link;
-	// Dimensions of last wl_buffer committed to background surface
-	int last_buffer_width, last_buffer_height;
+	// Background currently committed to the background surface, and the one
+	// to show once a worker is done rendering it
+	struct swaylock_background *background;
+	struct swaylock_background *pending_background;
+	// Buffer scale, 0 when mapped through the viewport, and surface size
+	// the background was committed with
+	int32_t background_scale;
+	uint32_t background_width, background_height;
+};
+
+enum image_load_state {
+	IMAGE_NOT_LOADED, // no output has needed the image so far
+	IMAGE_LOADING, // being decoded by a worker
+	IMAGE_LOADED,
+	IMAGE_FAILED,
 };
 
 // There is exactly one swaylock_image for each -i argument
 struct swaylock_image {
 	char *path;
 	char *output_name;
-	cairo_surface_t *cairo_surface;
+	cairo_surface_t *cairo_surface; // NULL until loaded
+	enum image_load_state load_state;
+	// Buffer size the image was decoded for, 0x0 if decoded at full size
+	int load_width, load_height;
+	bool reload; // a larger output showed up while it was being decoded
 	struct wl_list link;
 };
 
+// A fully rendered background buffer. Surfaces showing the same image at
+// the same buffer size share one of these, and unused ones are kept around
+// for a while so re-configuring to a known size does not render again.
+struct swaylock_background {
+	struct swaylock_image *image; // NULL for a solid color background
+	// Decoded image this was rendered from, NULL if loaded from disk
+	cairo_surface_t *source;
+	enum background_mode mode;
+	int width, height; // buffer size
+	struct pool_buffer buffer;
+	int refs; // number of surfaces displaying this background
+	bool rendering; // a worker is drawing into the buffer
+	// Rendered from an image decoded at least at the buffer size, so a
+	// larger decode for another output looks no different
+	bool complete;
+	struct wl_list link; // struct swaylock_state::backgrounds
+};
+
 void swaylock_handle_key(struct swaylock_state *state,
 		xkb_keysym_t keysym, uint32_t codepoint);
 void render_frame_background(struct swaylock_surface *surface);
 void render_frame(struct swaylock_surface *surface);
+void release_indicator(struct swaylock_surface *surface);
+void destroy_fonts(struct swaylock_state *state);
+void release_background(struct swaylock_state *state,
+		struct swaylock_background *background);
+bool background_is_cached(struct swaylock_state *state,
+		struct swaylock_image *image, int buffer_width, int buffer_height);
 void damage_surface(struct swaylock_surface *surface);
 void damage_state(struct swaylock_state *state);
 void clear_password_buffer(struct swaylock_password *pw);
+void schedule_image_load(struct swaylock_state *state,
+		struct swaylock_image *image);
+// Shows the image once it is decoded or captured, result is NULL if that
+// failed. Takes over the reference to result.
+void finish_image_load(struct swaylock_state *state,
+		struct swaylock_image *image, cairo_surface_t *result);
 void schedule_auth_idle(struct swaylock_state *state);
+void cancel_auth_timeout(struct swaylock_state *state);
+void clear_auth_texts(struct swaylock_state *state);
 
 void initialize_pw_backend(int argc, char **argv);
 void run_pw_backend_child(void);
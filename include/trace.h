@@ -0,0 +1,27 @@
+#ifndef _SWAYLOCK_TRACE_H
+#define _SWAYLOCK_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Events traced once per output
+enum trace_output_event {
+	TRACE_CONFIGURE = 1 << 0,
+	TRACE_BACKGROUND_COMMIT = 1 << 1,
+	TRACE_INDICATOR_COMMIT = 1 << 2,
+};
+
+// Starts writing the events recorded so far and all later ones to the file,
+// as JSON lines. "-" is stderr. With a NULL path, tracing is disabled.
+bool trace_open(const char *path);
+void trace_close(void);
+
+// Records a startup phase. Events before trace_open are kept until then, so
+// the name has to be a string literal.
+void trace_event(const char *event);
+// Records the event for the output, unless it already was. seen holds the
+// events recorded for the output so far.
+void trace_output_event(uint32_t *seen, enum trace_output_event event,
+		const char *output);
+
+#endif
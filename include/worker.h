@@ -0,0 +1,35 @@
+#ifndef _SWAYLOCK_WORKER_H
+#define _SWAYLOCK_WORKER_H
+#include <stdbool.h>
+
+/**
+ * A small pool of threads for work that should not block the event loop,
+ * like decoding background images or rendering them.
+ *
+ * Jobs run on one of the pool's threads. Once a job has run, its completion
+ * callback is invoked from loop_poll() on the main thread, so it is free to
+ * touch the rest of the swaylock state and to make Wayland requests.
+ */
+
+struct loop;
+struct worker_pool;
+
+/**
+ * Create a worker pool with the given number of threads, reporting
+ * completed jobs through the given event loop.
+ */
+struct worker_pool *worker_pool_create(struct loop *loop, int threads);
+
+/**
+ * Queue a job. `work` is called on a worker thread, `done` is then called on
+ * the main thread. Both receive `data`.
+ */
+bool worker_pool_submit(struct worker_pool *pool, void (*work)(void *data),
+		void (*done)(void *data), void *data);
+
+/**
+ * The number of threads to use for a pool sized to the machine.
+ */
+int worker_pool_default_size(void);
+
+#endif
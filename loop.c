@@ -2,38 +2,330 @@
 #include <limits.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <poll.h>
 #include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
+#include "config.h"
 #include "log.h"
 #include "loop.h"
+#if HAVE_EPOLL
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
 
 struct loop_fd_event {
 	void (*callback)(int fd, short mask, void *data);
 	void *data;
+	int fd;
 	struct wl_list link; // struct loop_fd_event::link
 };
 
+// Index of timers that are not in the heap
+#define TIMER_NOT_QUEUED SIZE_MAX
+
 struct loop_timer {
 	void (*callback)(void *data);
 	void *data;
 	struct timespec expiry;
-	bool removed;
-	struct wl_list link; // struct loop_timer::link
+	size_t index; // position in struct loop::timers
+	struct loop_timer *next_free; // struct loop::free_timers
 };
 
 struct loop {
+#if HAVE_EPOLL
+	int epoll_fd;
+	// Armed at the expiry of the first timer in the heap
+	int timer_fd;
+	struct timespec timer_fd_expiry;
+	// Events removed while epoll_wait results may still point to them
+	struct wl_list removed_fd_events; // struct loop_fd_event::link
+#else
 	struct pollfd *fds;
 	int fd_length;
 	int fd_capacity;
+#endif
 
 	struct wl_list fd_events; // struct loop_fd_event::link
-	struct wl_list timers; // struct loop_timer::link
+
+	// Binary min-heap of the pending timers, ordered by expiry
+	struct loop_timer **timers;
+	size_t timer_length;
+	size_t timer_capacity;
+	// Timers that fired or were removed, kept for reuse
+	struct loop_timer *free_timers;
 };
 
+static bool timer_before(const struct loop_timer *a, const struct loop_timer *b) {
+	return a->expiry.tv_sec < b->expiry.tv_sec ||
+		(a->expiry.tv_sec == b->expiry.tv_sec &&
+		 a->expiry.tv_nsec < b->expiry.tv_nsec);
+}
+
+static void heap_set(struct loop *loop, size_t index, struct loop_timer *timer) {
+	loop->timers[index] = timer;
+	timer->index = index;
+}
+
+static void heap_sift_up(struct loop *loop, size_t index) {
+	struct loop_timer *timer = loop->timers[index];
+	while (index > 0) {
+		size_t parent = (index - 1) / 2;
+		if (!timer_before(timer, loop->timers[parent])) {
+			break;
+		}
+		heap_set(loop, index, loop->timers[parent]);
+		index = parent;
+	}
+	heap_set(loop, index, timer);
+}
+
+static void heap_sift_down(struct loop *loop, size_t index) {
+	struct loop_timer *timer = loop->timers[index];
+	for (;;) {
+		size_t child = index * 2 + 1;
+		if (child >= loop->timer_length) {
+			break;
+		}
+		if (child + 1 < loop->timer_length &&
+				timer_before(loop->timers[child + 1], loop->timers[child])) {
+			++child;
+		}
+		if (!timer_before(loop->timers[child], timer)) {
+			break;
+		}
+		heap_set(loop, index, loop->timers[child]);
+		index = child;
+	}
+	heap_set(loop, index, timer);
+}
+
+static void heap_remove(struct loop *loop, struct loop_timer *timer) {
+	size_t index = timer->index;
+	struct loop_timer *last = loop->timers[--loop->timer_length];
+	timer->index = TIMER_NOT_QUEUED;
+	if (last == timer) {
+		return;
+	}
+	heap_set(loop, index, last);
+	if (index > 0 && timer_before(last, loop->timers[(index - 1) / 2])) {
+		heap_sift_up(loop, index);
+	} else {
+		heap_sift_down(loop, index);
+	}
+}
+
+static void free_timer(struct loop *loop, struct loop_timer *timer) {
+	timer->next_free = loop->free_timers;
+	loop->free_timers = timer;
+}
+
+static void dispatch_timers(struct loop *loop) {
+	struct loop_timer now = {0};
+	clock_gettime(CLOCK_MONOTONIC, &now.expiry);
+	// Timers added by the callbacks expire after now, so this ends
+	while (loop->timer_length > 0 &&
+			!timer_before(&now, loop->timers[0])) {
+		struct loop_timer *timer = loop->timers[0];
+		heap_remove(loop, timer);
+		timer->callback(timer->data);
+		free_timer(loop, timer);
+	}
+}
+
+#if HAVE_EPOLL
+
+struct loop *loop_create(void) {
+	struct loop *loop = calloc(1, sizeof(struct loop));
+	if (!loop) {
+		swaylock_log(LOG_ERROR, "Unable to allocate memory for loop");
+		return NULL;
+	}
+	wl_list_init(&loop->fd_events);
+	wl_list_init(&loop->removed_fd_events);
+
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd == -1) {
+		swaylock_log_errno(LOG_ERROR, "Unable to create epoll instance");
+		free(loop);
+		return NULL;
+	}
+	loop->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+		TFD_CLOEXEC | TFD_NONBLOCK);
+	if (loop->timer_fd == -1) {
+		swaylock_log_errno(LOG_ERROR, "Unable to create timerfd");
+		close(loop->epoll_fd);
+		free(loop);
+		return NULL;
+	}
+	// The timerfd is told apart from the other fds by its NULL data
+	struct epoll_event event = { .events = EPOLLIN };
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->timer_fd, &event) != 0) {
+		swaylock_log_errno(LOG_ERROR, "Unable to add timerfd to epoll");
+		close(loop->timer_fd);
+		close(loop->epoll_fd);
+		free(loop);
+		return NULL;
+	}
+	return loop;
+}
+
+static void free_removed_fd_events(struct loop *loop) {
+	struct loop_fd_event *event = NULL, *tmp_event = NULL;
+	wl_list_for_each_safe(event, tmp_event, &loop->removed_fd_events, link) {
+		wl_list_remove(&event->link);
+		free(event);
+	}
+}
+
+static void arm_timer_fd(struct loop *loop) {
+	struct itimerspec spec = {0};
+	if (loop->timer_length > 0) {
+		spec.it_value = loop->timers[0]->expiry;
+	}
+	if (spec.it_value.tv_sec == loop->timer_fd_expiry.tv_sec &&
+			spec.it_value.tv_nsec == loop->timer_fd_expiry.tv_nsec) {
+		return;
+	}
+	// A zero it_value disarms the timer. Otherwise an expiry in the past
+	// makes the timerfd readable right away.
+	if (timerfd_settime(loop->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) != 0) {
+		swaylock_log_errno(LOG_ERROR, "timerfd_settime failed");
+		exit(1);
+	}
+	loop->timer_fd_expiry = spec.it_value;
+}
+
+static short epoll_to_poll(uint32_t events) {
+	short mask = 0;
+	if (events & EPOLLIN) {
+		mask |= POLLIN;
+	}
+	if (events & EPOLLOUT) {
+		mask |= POLLOUT;
+	}
+	if (events & EPOLLERR) {
+		mask |= POLLERR;
+	}
+	if (events & EPOLLHUP) {
+		mask |= POLLHUP;
+	}
+	return mask;
+}
+
+static uint32_t poll_to_epoll(short mask) {
+	uint32_t events = 0;
+	if (mask & POLLIN) {
+		events |= EPOLLIN;
+	}
+	if (mask & POLLOUT) {
+		events |= EPOLLOUT;
+	}
+	return events;
+}
+
+void loop_destroy(struct loop *loop) {
+	struct loop_fd_event *event = NULL, *tmp_event = NULL;
+	wl_list_for_each_safe(event, tmp_event, &loop->fd_events, link) {
+		wl_list_remove(&event->link);
+		free(event);
+	}
+	free_removed_fd_events(loop);
+	for (size_t i = 0; i < loop->timer_length; ++i) {
+		free(loop->timers[i]);
+	}
+	while (loop->free_timers) {
+		struct loop_timer *timer = loop->free_timers;
+		loop->free_timers = timer->next_free;
+		free(timer);
+	}
+	free(loop->timers);
+	close(loop->timer_fd);
+	close(loop->epoll_fd);
+	free(loop);
+}
+
+void loop_poll(struct loop *loop) {
+	arm_timer_fd(loop);
+
+	struct epoll_event events[16];
+	int count = epoll_wait(loop->epoll_fd, events,
+		sizeof(events) / sizeof(events[0]), -1);
+	if (count < 0 && errno != EINTR) {
+		swaylock_log_errno(LOG_ERROR, "epoll_wait failed");
+		exit(1);
+	}
+
+	// Dispatch fds
+	bool timer_expired = false;
+	for (int i = 0; i < count; ++i) {
+		struct loop_fd_event *event = events[i].data.ptr;
+		if (!event) {
+			uint64_t expirations;
+			if (read(loop->timer_fd, &expirations, sizeof(expirations)) < 0 &&
+					errno != EAGAIN) {
+				swaylock_log_errno(LOG_ERROR, "Failed to read timerfd");
+			}
+			timer_expired = true;
+			continue;
+		}
+		if (event->callback) {
+			event->callback(event->fd, epoll_to_poll(events[i].events),
+				event->data);
+		}
+	}
+	free_removed_fd_events(loop);
+
+	// Dispatch timers. The clock is only read once the timerfd says the
+	// first timer is due.
+	if (timer_expired) {
+		dispatch_timers(loop);
+	}
+}
+
+void loop_add_fd(struct loop *loop, int fd, short mask,
+		void (*callback)(int fd, short mask, void *data), void *data) {
+	struct loop_fd_event *event = calloc(1, sizeof(struct loop_fd_event));
+	if (!event) {
+		swaylock_log(LOG_ERROR, "Unable to allocate memory for event");
+		return;
+	}
+	event->callback = callback;
+	event->data = data;
+	event->fd = fd;
+
+	struct epoll_event ev = {
+		.events = poll_to_epoll(mask),
+		.data.ptr = event,
+	};
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		swaylock_log_errno(LOG_ERROR, "Unable to add fd %d to epoll", fd);
+		free(event);
+		return;
+	}
+	wl_list_insert(loop->fd_events.prev, &event->link);
+}
+
+bool loop_remove_fd(struct loop *loop, int fd) {
+	struct loop_fd_event *event = NULL;
+	wl_list_for_each(event, &loop->fd_events, link) {
+		if (event->fd == fd) {
+			epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+			// Pending epoll_wait results may still point to the event
+			event->callback = NULL;
+			wl_list_remove(&event->link);
+			wl_list_insert(&loop->removed_fd_events, &event->link);
+			return true;
+		}
+	}
+	return false;
+}
+
+#else
+
 struct loop *loop_create(void) {
 	struct loop *loop = calloc(1, sizeof(struct loop));
 	if (!loop) {
@@ -43,7 +335,6 @@ struct loop *loop_create(void) {
 	loop->fd_capacity = 10;
 	loop->fds = malloc(sizeof(struct pollfd) * loop->fd_capacity);
 	wl_list_init(&loop->fd_events);
-	wl_list_init(&loop->timers);
 	return loop;
 }
 
@@ -53,11 +344,15 @@ void loop_destroy(struct loop *loop) {
 		wl_list_remove(&event->link);
 		free(event);
 	}
-	struct loop_timer *timer = NULL, *tmp_timer = NULL;
-	wl_list_for_each_safe(timer, tmp_timer, &loop->timers, link) {
-		wl_list_remove(&timer->link);
+	for (size_t i = 0; i < loop->timer_length; ++i) {
+		free(loop->timers[i]);
+	}
+	while (loop->free_timers) {
+		struct loop_timer *timer = loop->free_timers;
+		loop->free_timers = timer->next_free;
 		free(timer);
 	}
+	free(loop->timers);
 	free(loop->fds);
 	free(loop);
 }
@@ -65,17 +360,16 @@ void loop_destroy(struct loop *loop) {
 void loop_poll(struct loop *loop) {
 	// Calculate next timer in ms
 	int ms = INT_MAX;
-	if (!wl_list_empty(&loop->timers)) {
+	if (loop->timer_length > 0) {
 		struct timespec now;
 		clock_gettime(CLOCK_MONOTONIC, &now);
-		struct loop_timer *timer = NULL;
-		wl_list_for_each(timer, &loop->timers, link) {
-			int timer_ms = (timer->expiry.tv_sec - now.tv_sec) * 1000;
-			timer_ms += (timer->expiry.tv_nsec - now.tv_nsec) / 1000000;
-			if (timer_ms < ms) {
-				ms = timer_ms;
-			}
-		}
+		struct loop_timer *timer = loop->timers[0];
+		long long ns = (timer->expiry.tv_sec - now.tv_sec) * 1000000000LL +
+			(timer->expiry.tv_nsec - now.tv_nsec);
+		// Round up, waking up just before the timer expires would only
+		// mean polling again
+		long long timer_ms = ns <= 0 ? 0 : (ns + 999999) / 1000000;
+		ms = timer_ms < INT_MAX ? timer_ms : INT_MAX;
 	}
 	if (ms < 0) {
 		ms = 0;
@@ -104,26 +398,8 @@ void loop_poll(struct loop *loop) {
 	}
 
 	// Dispatch timers
-	if (!wl_list_empty(&loop->timers)) {
-		struct timespec now;
-		clock_gettime(CLOCK_MONOTONIC, &now);
-		struct loop_timer *timer = NULL, *tmp_timer = NULL;
-		wl_list_for_each_safe(timer, tmp_timer, &loop->timers, link) {
-			if (timer->removed) {
-				wl_list_remove(&timer->link);
-				free(timer);
-				continue;
-			}
-
-			bool expired = timer->expiry.tv_sec < now.tv_sec ||
-				(timer->expiry.tv_sec == now.tv_sec &&
-				 timer->expiry.tv_nsec < now.tv_nsec);
-			if (expired) {
-				timer->callback(timer->data);
-				wl_list_remove(&timer->link);
-				free(timer);
-			}
-		}
+	if (loop->timer_length > 0) {
+		dispatch_timers(loop);
 	}
 }
 
@@ -136,6 +412,7 @@ void loop_add_fd(struct loop *loop, int fd, short mask,
 	}
 	event->callback = callback;
 	event->data = data;
+	event->fd = fd;
 	wl_list_insert(loop->fd_events.prev, &event->link);
 
 	struct pollfd pfd = {fd, mask, 0};
@@ -149,31 +426,6 @@ void loop_add_fd(struct loop *loop, int fd, short mask,
 	loop->fds[loop->fd_length++] = pfd;
 }
 
-struct loop_timer *loop_add_timer(struct loop *loop, int ms,
-		void (*callback)(void *data), void *data) {
-	struct loop_timer *timer = calloc(1, sizeof(struct loop_timer));
-	if (!timer) {
-		swaylock_log(LOG_ERROR, "Unable to allocate memory for timer");
-		return NULL;
-	}
-	timer->callback = callback;
-	timer->data = data;
-
-	clock_gettime(CLOCK_MONOTONIC, &timer->expiry);
-	timer->expiry.tv_sec += ms / 1000;
-
-	long int nsec = (ms % 1000) * 1000000;
-	if (timer->expiry.tv_nsec + nsec >= 1000000000) {
-		timer->expiry.tv_sec++;
-		nsec -= 1000000000;
-	}
-	timer->expiry.tv_nsec += nsec;
-
-	wl_list_insert(&loop->timers, &timer->link);
-
-	return timer;
-}
-
 bool loop_remove_fd(struct loop *loop, int fd) {
 	size_t fd_index = 0;
 	struct loop_fd_event *event = NULL, *tmp_event = NULL;
@@ -192,13 +444,64 @@ bool loop_remove_fd(struct loop *loop, int fd) {
 	return false;
 }
 
-bool loop_remove_timer(struct loop *loop, struct loop_timer *remove) {
-	struct loop_timer *timer = NULL, *tmp_timer = NULL;
-	wl_list_for_each_safe(timer, tmp_timer, &loop->timers, link) {
-		if (timer == remove) {
-			timer->removed = true;
-			return true;
+#endif
+
+struct loop_timer *loop_add_timer(struct loop *loop, int ms,
+		void (*callback)(void *data), void *data) {
+	return loop_add_timer_slack(loop, ms, 0, callback, data);
+}
+
+struct loop_timer *loop_add_timer_slack(struct loop *loop, int ms, int slack_ms,
+		void (*callback)(void *data), void *data) {
+	if (loop->timer_length == loop->timer_capacity) {
+		size_t capacity = loop->timer_capacity ? loop->timer_capacity * 2 : 8;
+		struct loop_timer **timers =
+			realloc(loop->timers, sizeof(*timers) * capacity);
+		if (!timers) {
+			swaylock_log(LOG_ERROR, "Unable to allocate memory for timer");
+			return NULL;
 		}
+		loop->timers = timers;
+		loop->timer_capacity = capacity;
 	}
-	return false;
+
+	struct loop_timer *timer = loop->free_timers;
+	if (timer) {
+		loop->free_timers = timer->next_free;
+	} else {
+		timer = malloc(sizeof(struct loop_timer));
+		if (!timer) {
+			swaylock_log(LOG_ERROR, "Unable to allocate memory for timer");
+			return NULL;
+		}
+	}
+	timer->callback = callback;
+	timer->data = data;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t expiry = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec +
+		(int64_t)ms * 1000000;
+	if (slack_ms > 0) {
+		// Round up to a multiple of the slack, so timers which expire
+		// within the same window share a single wakeup
+		int64_t slack = (int64_t)slack_ms * 1000000;
+		expiry = (expiry + slack - 1) / slack * slack;
+	}
+	timer->expiry.tv_sec = expiry / 1000000000;
+	timer->expiry.tv_nsec = expiry % 1000000000;
+
+	loop->timers[loop->timer_length] = timer;
+	heap_sift_up(loop, loop->timer_length++);
+
+	return timer;
+}
+
+bool loop_remove_timer(struct loop *loop, struct loop_timer *timer) {
+	if (timer->index == TIMER_NOT_QUEUED) {
+		return false;
+	}
+	heap_remove(loop, timer);
+	free_timer(loop, timer);
+	return true;
 }
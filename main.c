@@ -18,14 +18,35 @@
 #include <wordexp.h>
 #include "background-image.h"
 #include "cairo.h"
+#include "clock.h"
 #include "comm.h"
+#if HAVE_DMABUF
+#include "dmabuf.h"
+#endif
 #include "log.h"
 #include "loop.h"
 #include "password-buffer.h"
 #include "pool-buffer.h"
 #include "seat.h"
+#include "stats.h"
 #include "swaylock.h"
+#include "trace.h"
+#include "worker.h"
 #include "ext-session-lock-v1-client-protocol.h"
+#include "fractional-scale-v1-client-protocol.h"
+#include "single-pixel-buffer-v1-client-protocol.h"
+#include "viewporter-client-protocol.h"
+#if HAVE_DMABUF
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
+#endif
+#if HAVE_IMAGE_COPY_CAPTURE
+#include "screenshot.h"
+#include "ext-image-capture-source-v1-client-protocol.h"
+#include "ext-image-copy-capture-v1-client-protocol.h"
+
+// How long to wait for the outputs to be captured before locking anyway
+#define SCREENSHOT_TIMEOUT_MS 2000
+#endif
 
 static uint32_t parse_color(const char *color) {
 	if (color[0] == '#') {
@@ -65,58 +86,104 @@ static void destroy_surface(struct swaylock_surface *surface) {
 	if (surface->subsurface) {
 		wl_subsurface_destroy(surface->subsurface);
 	}
+	if (surface->viewport) {
+		wp_viewport_destroy(surface->viewport);
+	}
+	if (surface->child_viewport) {
+		wp_viewport_destroy(surface->child_viewport);
+	}
+	if (surface->fractional_scale_v1) {
+		wp_fractional_scale_v1_destroy(surface->fractional_scale_v1);
+	}
 	if (surface->child) {
 		wl_surface_destroy(surface->child);
 	}
 	if (surface->surface != NULL) {
 		wl_surface_destroy(surface->surface);
 	}
-	destroy_buffer(&surface->indicator_buffers[0]);
-	destroy_buffer(&surface->indicator_buffers[1]);
+	if (surface->background) {
+		release_background(surface->state, surface->background);
+	}
+	release_indicator(surface);
 	wl_output_release(surface->output);
 	free(surface);
 }
 
 static const struct ext_session_lock_surface_v1_listener ext_session_lock_surface_v1_listener;
 
-static cairo_surface_t *select_image(struct swaylock_state *state,
+static struct swaylock_image *select_image(struct swaylock_state *state,
 		struct swaylock_surface *surface);
 
 static bool surface_is_opaque(struct swaylock_surface *surface) {
-	if (surface->image) {
-		return cairo_surface_get_content(surface->image) == CAIRO_CONTENT_COLOR;
+	if (surface->image && surface->image->cairo_surface) {
+		return cairo_surface_get_content(surface->image->cairo_surface) ==
+			CAIRO_CONTENT_COLOR;
 	}
 	return (surface->state->args.colors.background & 0xff) == 0xff;
 }
 
+static void update_opaque_region(struct swaylock_surface *surface) {
+	if (surface_is_opaque(surface) &&
+			surface->state->args.mode != BACKGROUND_MODE_CENTER &&
+			surface->state->args.mode != BACKGROUND_MODE_FIT) {
+		struct wl_region *region =
+			wl_compositor_create_region(surface->state->compositor);
+		wl_region_add(region, 0, 0, INT32_MAX, INT32_MAX);
+		wl_surface_set_opaque_region(surface->surface, region);
+		wl_region_destroy(region);
+	} else {
+		wl_surface_set_opaque_region(surface->surface, NULL);
+	}
+}
+
+static void fractional_scale_handle_preferred_scale(void *data,
+		struct wp_fractional_scale_v1 *fractional_scale, uint32_t scale) {
+	struct swaylock_surface *surface = data;
+	if (surface->fractional_scale == scale) {
+		return;
+	}
+	surface->fractional_scale = scale;
+	if (surface->width != 0 && surface->height != 0) {
+		render_frame_background(surface);
+		damage_surface(surface);
+	}
+}
+
+static const struct wp_fractional_scale_v1_listener fractional_scale_listener = {
+	.preferred_scale = fractional_scale_handle_preferred_scale,
+};
+
 static void create_surface(struct swaylock_surface *surface) {
 	struct swaylock_state *state = surface->state;
 
-	surface->image = select_image(state, surface);
-
 	surface->surface = wl_compositor_create_surface(state->compositor);
 	assert(surface->surface);
 
 	surface->child = wl_compositor_create_surface(state->compositor);
 	assert(surface->child);
+
+	if (!surface->stats) {
+		surface->stats = stats_get_output(surface->output_name);
+	}
 	surface->subsurface = wl_subcompositor_get_subsurface(state->subcompositor, surface->child, surface->surface);
 	assert(surface->subsurface);
 	wl_subsurface_set_sync(surface->subsurface);
 
+	// Fractional scales are applied through viewports
+	if (state->fractional_scale_manager && state->viewporter) {
+		surface->fractional_scale_v1 =
+			wp_fractional_scale_manager_v1_get_fractional_scale(
+				state->fractional_scale_manager, surface->surface);
+		wp_fractional_scale_v1_add_listener(surface->fractional_scale_v1,
+			&fractional_scale_listener, surface);
+	}
+
 	surface->ext_session_lock_surface_v1 = ext_session_lock_v1_get_lock_surface(
 		state->ext_session_lock_v1, surface->surface, surface->output);
 	ext_session_lock_surface_v1_add_listener(surface->ext_session_lock_surface_v1,
 		&ext_session_lock_surface_v1_listener, surface);
 
-	if (surface_is_opaque(surface) &&
-			surface->state->args.mode != BACKGROUND_MODE_CENTER &&
-			surface->state->args.mode != BACKGROUND_MODE_FIT) {
-		struct wl_region *region =
-			wl_compositor_create_region(surface->state->compositor);
-		wl_region_add(region, 0, 0, INT32_MAX, INT32_MAX);
-		wl_surface_set_opaque_region(surface->surface, region);
-		wl_region_destroy(region);
-	}
+	update_opaque_region(surface);
 
 	surface->created = true;
 }
@@ -125,9 +192,14 @@ static void ext_session_lock_surface_v1_handle_configure(void *data,
 		struct ext_session_lock_surface_v1 *lock_surface, uint32_t serial,
 		uint32_t width, uint32_t height) {
 	struct swaylock_surface *surface = data;
+	trace_output_event(&surface->traced, TRACE_CONFIGURE,
+		surface->output_name);
 	surface->width = width;
 	surface->height = height;
 	ext_session_lock_surface_v1_ack_configure(lock_surface, serial);
+	// Outputs coming and going configure the others again at the size they
+	// already have. The background is then left as it is, only the
+	// indicator commits.
 	render_frame_background(surface);
 	render_frame(surface);
 }
@@ -145,7 +217,16 @@ static void surface_frame_handle_done(void *data, struct wl_callback *callback,
 	wl_callback_destroy(callback);
 	surface->frame_pending = false;
 
-	if (surface->dirty) {
+	// The frame committed last is presented now
+	if (surface->committed_key_time.tv_sec != 0 ||
+			surface->committed_key_time.tv_nsec != 0) {
+		stats_record_time(surface->stats, STATS_KEY_TO_PRESENT,
+			&surface->committed_key_time);
+		surface->committed_key_time = (struct timespec){0};
+	}
+
+	// Animations draw on every frame until they are done
+	if (surface->dirty || surface->indicator_frame.animating) {
 		// Schedule a frame in case the surface is damaged again
 		struct wl_callback *callback = wl_surface_frame(surface->surface);
 		wl_callback_add_listener(callback, &surface_frame_listener, surface);
@@ -153,6 +234,8 @@ static void surface_frame_handle_done(void *data, struct wl_callback *callback,
 
 		render_frame(surface);
 		surface->dirty = false;
+		surface->committed_key_time = surface->key_time;
+		surface->key_time = (struct timespec){0};
 	}
 }
 
@@ -178,10 +261,31 @@ void damage_surface(struct swaylock_surface *surface) {
 }
 
 void damage_state(struct swaylock_state *state) {
+	// Deferred to flush_state_damage, so a burst of key events only
+	// schedules one frame
+	state->damaged = true;
+}
+
+static void flush_state_damage(struct swaylock_state *state) {
+	if (state->highlight_pending) {
+		// Advance a random amount between 1/4 and 3/4 of a full turn
+		state->highlight_start =
+			(state->highlight_start + (rand() % 1024) + 512) % 2048;
+		state->highlight_pending = false;
+	}
+	if (!state->damaged) {
+		return;
+	}
+	state->damaged = false;
+
 	struct swaylock_surface *surface;
 	wl_list_for_each(surface, &state->surfaces, link) {
+		if (surface->key_time.tv_sec == 0 && surface->key_time.tv_nsec == 0) {
+			surface->key_time = state->key_time;
+		}
 		damage_surface(surface);
 	}
+	state->key_time = (struct timespec){0};
 }
 
 static void handle_wl_output_geometry(void *data, struct wl_output *wl_output,
@@ -189,19 +293,47 @@ static void handle_wl_output_geometry(void *data, struct wl_output *wl_output,
 		int32_t subpixel, const char *make, const char *model,
 		int32_t transform) {
 	struct swaylock_surface *surface = data;
+	bool changed = surface->subpixel != (enum wl_output_subpixel)subpixel ||
+		surface->transform != (enum wl_output_transform)transform;
 	surface->subpixel = subpixel;
-	if (surface->state->run_display) {
+	surface->transform = transform;
+	if (changed && surface->state->run_display) {
 		damage_surface(surface);
 	}
 }
 
 static void handle_wl_output_mode(void *data, struct wl_output *output,
 		uint32_t flags, int32_t width, int32_t height, int32_t refresh) {
-	// Who cares
+	struct swaylock_surface *surface = data;
+	if (flags & WL_OUTPUT_MODE_CURRENT) {
+		surface->mode_width = width;
+		surface->mode_height = height;
+	}
+}
+
+// Size of the output's current mode, as seen by surfaces on it
+static void get_output_pixel_size(struct swaylock_surface *surface,
+		int *width, int *height) {
+	*width = surface->mode_width;
+	*height = surface->mode_height;
+	if (surface->transform % 2 == 1) {
+		// Rotated by 90 or 270 degrees
+		*width = surface->mode_height;
+		*height = surface->mode_width;
+	}
 }
 
 static void handle_wl_output_done(void *data, struct wl_output *output) {
 	struct swaylock_surface *surface = data;
+	// The output name is known by now, so the image for this output can be
+	// decoded while the session is being locked. Nothing needs decoding if
+	// the background is already in the cache.
+	surface->image = select_image(surface->state, surface);
+	int width, height;
+	get_output_pixel_size(surface, &width, &height);
+	if (!background_is_cached(surface->state, surface->image, width, height)) {
+		schedule_image_load(surface->state, surface->image);
+	}
 	if (!surface->created && surface->state->run_display) {
 		create_surface(surface);
 	}
@@ -210,6 +342,9 @@ static void handle_wl_output_done(void *data, struct wl_output *output) {
 static void handle_wl_output_scale(void *data, struct wl_output *output,
 		int32_t factor) {
 	struct swaylock_surface *surface = data;
+	if (surface->scale == factor) {
+		return;
+	}
 	surface->scale = factor;
 	if (surface->state->run_display) {
 		damage_surface(surface);
@@ -220,6 +355,15 @@ static void handle_wl_output_name(void *data, struct wl_output *output,
 		const char *name) {
 	struct swaylock_surface *surface = data;
 	surface->output_name = strdup(name);
+	surface->stats = stats_get_output(name);
+#if HAVE_IMAGE_COPY_CAPTURE
+	// Outputs showing up once the session is locked only show the lock
+	// screen, there is nothing to capture
+	if (surface->state->args.screenshots && surface->output_name &&
+			!surface->state->ext_session_lock_v1) {
+		screenshot_output(surface);
+	}
+#endif
 }
 
 static void handle_wl_output_description(void *data, struct wl_output *output,
@@ -239,6 +383,7 @@ struct wl_output_listener _wl_output_listener = {
 static void ext_session_lock_v1_handle_locked(void *data, struct ext_session_lock_v1 *lock) {
 	struct swaylock_state *state = data;
 	state->locked = true;
+	trace_event("locked");
 }
 
 static void ext_session_lock_v1_handle_finished(void *data, struct ext_session_lock_v1 *lock) {
@@ -271,8 +416,37 @@ static void handle_global(void *data, struct wl_registry *registry, uint32_t nam
 		surface->output_global_name = name;
 		wl_output_add_listener(surface->output, &_wl_output_listener, surface);
 		wl_list_insert(&state->surfaces, &surface->link);
+		int surfaces = wl_list_length(&state->surfaces);
+		if (surfaces > state->max_surfaces) {
+			state->max_surfaces = surfaces;
+		}
 	} else if (strcmp(interface, ext_session_lock_manager_v1_interface.name) == 0) {
 		state->ext_session_lock_manager_v1 = wl_registry_bind(registry, name, &ext_session_lock_manager_v1_interface, 1);
+	} else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+		state->viewporter = wl_registry_bind(registry, name, &wp_viewporter_interface, 1);
+	} else if (strcmp(interface, wp_fractional_scale_manager_v1_interface.name) == 0) {
+		state->fractional_scale_manager = wl_registry_bind(registry, name,
+			&wp_fractional_scale_manager_v1_interface, 1);
+	} else if (strcmp(interface, wp_single_pixel_buffer_manager_v1_interface.name) == 0) {
+		state->single_pixel_buffer_manager = wl_registry_bind(registry, name,
+			&wp_single_pixel_buffer_manager_v1_interface, 1);
+#if HAVE_DMABUF
+	} else if (strcmp(interface, zwp_linux_dmabuf_v1_interface.name) == 0) {
+		// Version 3 announces the supported modifiers
+		if (state->args.dmabuf && version >= 3) {
+			struct zwp_linux_dmabuf_v1 *dmabuf = wl_registry_bind(registry,
+				name, &zwp_linux_dmabuf_v1_interface, 3);
+			dmabuf_init(state->display, dmabuf);
+		}
+#endif
+#if HAVE_IMAGE_COPY_CAPTURE
+	} else if (strcmp(interface, ext_output_image_capture_source_manager_v1_interface.name) == 0) {
+		state->output_capture_source_manager = wl_registry_bind(registry, name,
+			&ext_output_image_capture_source_manager_v1_interface, 1);
+	} else if (strcmp(interface, ext_image_copy_capture_manager_v1_interface.name) == 0) {
+		state->image_copy_capture_manager = wl_registry_bind(registry, name,
+			&ext_image_copy_capture_manager_v1_interface, 1);
+#endif
 	}
 }
 
@@ -295,22 +469,184 @@ static const struct wl_registry_listener registry_listener = {
 static int sigusr_fds[2] = {-1, -1};
 
 void do_sigusr(int sig) {
-	(void)write(sigusr_fds[1], "1", 1);
+	char c = sig == SIGUSR2 ? '2' : '1';
+	(void)write(sigusr_fds[1], &c, 1);
 }
 
-static cairo_surface_t *select_image(struct swaylock_state *state, struct swaylock_surface *surface) {
+static struct swaylock_image *select_image(struct swaylock_state *state,
+		struct swaylock_surface *surface) {
 	struct swaylock_image *image;
-	cairo_surface_t *default_image = NULL;
+	struct swaylock_image *default_image = NULL;
 	wl_list_for_each(image, &state->images, link) {
+		if (image->load_state == IMAGE_FAILED) {
+			continue;
+		}
 		if (lenient_strcmp(image->output_name, surface->output_name) == 0) {
-			return image->cairo_surface;
+			return image;
 		} else if (!image->output_name) {
-			default_image = image->cairo_surface;
+			default_image = image;
 		}
 	}
 	return default_image;
 }
 
+// Largest buffer size any output showing the image needs, 0x0 if unknown
+static void get_image_load_size(struct swaylock_state *state,
+		struct swaylock_image *image, int *width, int *height) {
+	*width = 0;
+	*height = 0;
+	if (!state->args.downscale_images) {
+		return;
+	}
+
+	struct swaylock_surface *surface;
+	wl_list_for_each(surface, &state->surfaces, link) {
+		if (surface->image != image) {
+			continue;
+		}
+		int mode_width, mode_height;
+		get_output_pixel_size(surface, &mode_width, &mode_height);
+		if (mode_width <= 0 || mode_height <= 0) {
+			*width = 0;
+			*height = 0;
+			return;
+		}
+		if (mode_width > *width) {
+			*width = mode_width;
+		}
+		if (mode_height > *height) {
+			*height = mode_height;
+		}
+	}
+}
+
+static bool image_needs_reload(struct swaylock_image *image,
+		int width, int height) {
+	if (image->load_width == 0 && image->load_height == 0) {
+		return false; // already at full size
+	}
+	return width == 0 || height == 0 ||
+		width > image->load_width || height > image->load_height;
+}
+
+struct image_load {
+	struct swaylock_state *state;
+	struct swaylock_image *image;
+	enum background_mode mode;
+	int width, height;
+	cairo_surface_t *result;
+};
+
+static void image_load_work(void *data) {
+	struct image_load *load = data;
+	load->result = load_background_image_at_size(load->image->path,
+		load->mode, load->width, load->height);
+}
+
+void finish_image_load(struct swaylock_state *state,
+		struct swaylock_image *image, cairo_surface_t *result) {
+	if (!result && image->cairo_surface) {
+		// Reloading for a larger output failed, keep the smaller version
+		image->load_state = IMAGE_LOADED;
+		return;
+	} else if (!result) {
+		image->load_state = IMAGE_FAILED;
+		// Fall back to whichever image would have been picked without it
+		struct swaylock_surface *surface;
+		wl_list_for_each(surface, &state->surfaces, link) {
+			if (surface->image != image) {
+				continue;
+			}
+			struct swaylock_image *fallback = select_image(state, surface);
+			surface->image = fallback;
+			schedule_image_load(state, fallback);
+			// Nothing calls back for a solid color or an image that is
+			// already there
+			if (surface->created && (!fallback || fallback->cairo_surface ||
+						fallback->load_state != IMAGE_LOADING)) {
+				update_opaque_region(surface);
+				render_frame_background(surface);
+			}
+		}
+		return;
+	}
+
+	// Backgrounds rendered from the previous version hold their own
+	// reference to it
+	if (image->cairo_surface) {
+		cairo_surface_destroy(image->cairo_surface);
+	}
+	image->cairo_surface = result;
+	image->load_state = IMAGE_LOADED;
+	swaylock_log(LOG_DEBUG, "Loaded image %s for output %s",
+			image->path ? image->path : "(screenshot)",
+			image->output_name ? image->output_name : "*");
+
+	struct swaylock_surface *surface;
+	wl_list_for_each(surface, &state->surfaces, link) {
+		if (surface->image == image && surface->created) {
+			update_opaque_region(surface);
+			render_frame_background(surface);
+		}
+	}
+
+	if (image->reload) {
+		image->reload = false;
+		schedule_image_load(state, image);
+	}
+}
+
+static void image_load_done(void *data) {
+	struct image_load *load = data;
+	struct swaylock_state *state = load->state;
+	struct swaylock_image *image = load->image;
+	cairo_surface_t *result = load->result;
+	free(load);
+	finish_image_load(state, image, result);
+}
+
+void schedule_image_load(struct swaylock_state *state,
+		struct swaylock_image *image) {
+	if (!image || image->load_state == IMAGE_FAILED) {
+		return;
+	}
+
+	int width, height;
+	get_image_load_size(state, image, &width, &height);
+	if (image->load_state == IMAGE_LOADING) {
+		if (image_needs_reload(image, width, height)) {
+			image->reload = true;
+		}
+		return;
+	} else if (image->load_state == IMAGE_LOADED &&
+			!image_needs_reload(image, width, height)) {
+		return;
+	}
+
+	struct image_load *load = calloc(1, sizeof(struct image_load));
+	if (!load) {
+		swaylock_log(LOG_ERROR, "Unable to allocate memory for image load");
+		return;
+	}
+	load->state = state;
+	load->image = image;
+	load->mode = state->args.mode;
+	load->width = width;
+	load->height = height;
+
+	image->load_state = IMAGE_LOADING;
+	image->load_width = width;
+	image->load_height = height;
+	if (state->workers && worker_pool_submit(state->workers,
+				image_load_work, image_load_done, load)) {
+		return;
+	}
+
+	// No worker available, decode right away
+	image_load_work(load);
+	image_load_done(load);
+}
+
 static char *join_args(char **argv, int argc) {
 	assert(argc > 0);
 	int len = 0, i;
@@ -353,7 +689,6 @@ static void load_image(char *arg, struct swaylock_state *state) {
 						image->path);
 			}
 			wl_list_remove(&iter_image->link);
-			free(iter_image->cairo_surface);
 			free(iter_image->output_name);
 			free(iter_image->path);
 			free(iter_image);
@@ -377,14 +712,9 @@ static void load_image(char *arg, struct swaylock_state *state) {
 		wordfree(&p);
 	}
 
-	// Load the actual image
-	image->cairo_surface = load_background_image(image->path);
-	if (!image->cairo_surface) {
-		free(image);
-		return;
-	}
+	// The image is only decoded once an output that shows it shows up
 	wl_list_insert(&state->images, &image->link);
-	swaylock_log(LOG_DEBUG, "Loaded image %s for output %s", image->path,
+	swaylock_log(LOG_DEBUG, "Using image %s for output %s", image->path,
 			image->output_name ? image->output_name : "*");
 }
 
@@ -399,6 +729,24 @@ static void set_default_colors(struct swaylock_colors *colors) {
 	colors->highlight_wrong = 0xC0392BFF;
 }
 
+// Effects are applied in the order they are given in
+static bool add_effect(struct swaylock_state *state, enum effect_type type,
+		const char *arg) {
+	struct effect effect;
+	if (!parse_effect(type, arg, &effect)) {
+		return false;
+	}
+	struct effect *effects = realloc(state->args.effects,
+		(state->args.effects_count + 1) * sizeof(struct effect));
+	if (!effects) {
+		swaylock_log(LOG_ERROR, "Unable to allocate memory for effect");
+		return false;
+	}
+	effects[state->args.effects_count++] = effect;
+	state->args.effects = effects;
+	return true;
+}
+
 enum line_mode {
 	LM_LINE,
 	LM_INSIDE,
@@ -415,6 +763,11 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state, en
 
 		_UNUSED = 256,
 
+		LO_TIMER_SLACK,
+		LO_AUTH_TIMEOUT,
+		LO_TRACE,
+		LO_STATS_FILE,
+
 		LO_IGNORE_EMPTY,
 		LO_NO_INDICATOR,
 		LO_IND_IDLE_VISIBLE,
@@ -422,9 +775,21 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state, en
 		LO_IND_THICKNESS,
 		LO_IND_X,
 		LO_IND_Y,	
+		LO_IND_BUFFERS,
+		LO_ANIMATION_DURATION,
+		LO_ANIMATION_BUDGET,
 		
 		LO_BACKGROUND_COLOR,
 		LO_BACKGROUND_MODE,
+		LO_DOWNSCALE_IMAGES,
+		LO_CACHE_BACKGROUNDS,
+		LO_DMABUF,
+		LO_COMPOSITOR_SCALING,
+		LO_SCREENSHOTS,
+		LO_EFFECT_BLUR,
+		LO_EFFECT_PIXELATE,
+		LO_EFFECT_DIM,
+		LO_EFFECT_VIGNETTE,
 		
 		LO_FONT,
 		LO_FONT_SIZE,
@@ -449,6 +814,10 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state, en
 		{"help", no_argument, NULL, LO_HELP},
 		{"version", no_argument, NULL, LO_VERSION},
 		{"image", required_argument, NULL, LO_IMAGE},
+		{"timer-slack", required_argument, NULL, LO_TIMER_SLACK},
+		{"auth-timeout", required_argument, NULL, LO_AUTH_TIMEOUT},
+		{"trace", required_argument, NULL, LO_TRACE},
+		{"stats-file", required_argument, NULL, LO_STATS_FILE},
 		// input & indicator	
 		{"ignore-empty-password", no_argument, NULL, LO_IGNORE_EMPTY},
 		{"no-indicator", no_argument, NULL, LO_NO_INDICATOR},
@@ -457,9 +826,21 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state, en
 		{"indicator-thickness", required_argument, NULL, LO_IND_THICKNESS},
 		{"indicator-x-position", required_argument, NULL, LO_IND_X},
 		{"indicator-y-position", required_argument, NULL, LO_IND_Y},
+		{"indicator-buffers", required_argument, NULL, LO_IND_BUFFERS},
+		{"animation-duration", required_argument, NULL, LO_ANIMATION_DURATION},
+		{"animation-budget", required_argument, NULL, LO_ANIMATION_BUDGET},
 		// background
 		{"color-background", required_argument, NULL, LO_BACKGROUND_COLOR},
 		{"scaling", required_argument, NULL, LO_BACKGROUND_MODE},
+		{"downscale-images", no_argument, NULL, LO_DOWNSCALE_IMAGES},
+		{"cache-backgrounds", no_argument, NULL, LO_CACHE_BACKGROUNDS},
+		{"dmabuf", no_argument, NULL, LO_DMABUF},
+		{"compositor-scaling", no_argument, NULL, LO_COMPOSITOR_SCALING},
+		{"screenshots", no_argument, NULL, LO_SCREENSHOTS},
+		{"effect-blur", required_argument, NULL, LO_EFFECT_BLUR},
+		{"effect-pixelate", required_argument, NULL, LO_EFFECT_PIXELATE},
+		{"effect-dim", required_argument, NULL, LO_EFFECT_DIM},
+		{"effect-vignette", required_argument, NULL, LO_EFFECT_VIGNETTE},
 		// font
 		{"font", required_argument, NULL, LO_FONT},
 		{"font-size", required_argument, NULL, LO_FONT_SIZE},
@@ -491,6 +872,14 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state, en
 			"Display the given image, optionally only on the given output.\n"
 		"  -v, --version                    "
 			"Show the version number and quit.\n"
+		"  --timer-slack <ms>               "
+			"Let idle and clock timers fire up to <ms> late, 50 by default.\n"
+		"  --auth-timeout <seconds>         "
+			"Give up on a password check after <seconds>, 0 to wait forever.\n"
+		"  --trace <file>                   "
+			"Append startup timings to <file> as JSON lines, - for stderr.\n"
+		"  --stats-file <file>              "
+			"Append frame stats to <file> on exit and on SIGUSR2.\n"
 		"  --ignore-empty-password          "
 			"When an empty password is provided, do not validate it.\n"
 		" --no-indicator                    "
@@ -505,8 +894,32 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state, en
 			"Sets the horizontal position of the indicator.\n"
 		"  --indicator-y-position <y>       "
 			"Sets the vertical position of the indicator.\n"
+		"  --indicator-buffers <count>      "
+			"Number of buffers kept per indicator, 3 by default.\n"
+		"  --animation-duration <ms>        "
+			"Fade the indicator between states in <ms>, 0 to snap.\n"
+		"  --animation-budget <us>          "
+			"Skip animations whose frames take over <us>, 0 for no limit.\n"
 		"  --scaling <mode>                 "
 			"Image scaling mode: stretch, fill, fit, center, tile, solid_color.\n"
+		"  --downscale-images               "
+			"Decode images at the size of the largest output showing them.\n"
+		"  --cache-backgrounds              "
+			"Keep rendered backgrounds in $XDG_CACHE_HOME/swaylock.\n"
+		"  --dmabuf                         "
+			"Share backgrounds with the compositor as GPU buffers.\n"
+		"  --compositor-scaling             "
+			"Let the compositor scale up small images.\n"
+		"  --screenshots                    "
+			"Show what each output showed before locking.\n"
+		"  --effect-blur <radius>[x<n>]     "
+			"Blur the image with <n> box blurs, 3 by default.\n"
+		"  --effect-pixelate <size>         "
+			"Pixelate the image into blocks of <size> pixels.\n"
+		"  --effect-dim <amount>            "
+			"Darken the image by <amount>, from 0 to 1.\n"
+		"  --effect-vignette <base>:<f>     "
+			"Darken the edges to <base>, <f> less towards the center.\n"
 		"  --font <font>                    "
 			"Sets the font of the text.\n"
 		"  --font-size <size>               "
@@ -561,6 +974,40 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state, en
 				load_image(optarg, state);
 			}
 			break;
+		case LO_TIMER_SLACK:
+			if (state) {
+				int slack = strtol(optarg, NULL, 0);
+				if (slack < 0) {
+					swaylock_log(LOG_ERROR, "Invalid timer slack '%s', it "
+						"must not be negative", optarg);
+					return 1;
+				}
+				state->args.timer_slack = slack;
+			}
+			break;
+		case LO_AUTH_TIMEOUT:
+			if (state) {
+				int timeout = strtol(optarg, NULL, 0);
+				if (timeout < 0) {
+					swaylock_log(LOG_ERROR, "Invalid auth timeout '%s', it "
+						"must not be negative", optarg);
+					return 1;
+				}
+				state->args.auth_timeout = timeout;
+			}
+			break;
+		case LO_TRACE:
+			if (state) {
+				free(state->args.trace_path);
+				state->args.trace_path = strdup(optarg);
+			}
+			break;
+		case LO_STATS_FILE:
+			if (state) {
+				free(state->args.stats_path);
+				state->args.stats_path = strdup(optarg);
+			}
+			break;
 		case LO_IGNORE_EMPTY:
 			if (state) {
 				state->args.ignore_empty = true;
@@ -581,6 +1028,39 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state, en
 				state->args.radius = strtol(optarg, NULL, 0);
 			}
 			break;
+		case LO_IND_BUFFERS:
+			if (state) {
+				int count = strtol(optarg, NULL, 0);
+				if (count < 1) {
+					swaylock_log(LOG_ERROR, "Invalid indicator buffer count "
+						"'%s', it must be at least 1", optarg);
+					return 1;
+				}
+				state->args.indicator_buffers = count;
+			}
+			break;
+		case LO_ANIMATION_DURATION:
+			if (state) {
+				int duration = strtol(optarg, NULL, 0);
+				if (duration < 0) {
+					swaylock_log(LOG_ERROR, "Invalid animation duration "
+						"'%s', it must not be negative", optarg);
+					return 1;
+				}
+				state->args.animation_duration = duration;
+			}
+			break;
+		case LO_ANIMATION_BUDGET:
+			if (state) {
+				int budget = strtol(optarg, NULL, 0);
+				if (budget < 0) {
+					swaylock_log(LOG_ERROR, "Invalid animation budget "
+						"'%s', it must not be negative", optarg);
+					return 1;
+				}
+				state->args.animation_budget = budget;
+			}
+			break;
 		case LO_IND_THICKNESS:
 			if (state) {
 				state->args.thickness = strtol(optarg, NULL, 0);
@@ -604,6 +1084,52 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state, en
 				}
 			}
 			break;
+		case LO_DOWNSCALE_IMAGES:
+			if (state) {
+				state->args.downscale_images = true;
+			}
+			break;
+		case LO_CACHE_BACKGROUNDS:
+			if (state) {
+				state->args.cache_backgrounds = true;
+			}
+			break;
+		case LO_COMPOSITOR_SCALING:
+			if (state) {
+				state->args.compositor_scaling = true;
+			}
+			break;
+		case LO_EFFECT_BLUR:
+		case LO_EFFECT_PIXELATE:
+		case LO_EFFECT_DIM:
+		case LO_EFFECT_VIGNETTE:
+			if (state && !add_effect(state, c == LO_EFFECT_BLUR ? EFFECT_BLUR :
+						c == LO_EFFECT_PIXELATE ? EFFECT_PIXELATE :
+						c == LO_EFFECT_DIM ? EFFECT_DIM : EFFECT_VIGNETTE,
+						optarg)) {
+				return 1;
+			}
+			break;
+		case LO_SCREENSHOTS:
+			if (state) {
+#if HAVE_IMAGE_COPY_CAPTURE
+				state->args.screenshots = true;
+#else
+				swaylock_log(LOG_ERROR, "swaylock was built without "
+					"screenshot support, showing images instead");
+#endif
+			}
+			break;
+		case LO_DMABUF:
+			if (state) {
+#if HAVE_DMABUF
+				state->args.dmabuf = true;
+#else
+				swaylock_log(LOG_ERROR, "swaylock was built without dmabuf "
+					"support, using shared memory buffers");
+#endif
+			}
+			break;
 		case LO_FONT:
 			if (state) {
 				free(state->args.font);
@@ -761,19 +1287,62 @@ static void display_in(int fd, short mask, void *data) {
 }
 
 static void comm_in(int fd, short mask, void *data) {
-	if (read_comm_reply()) {
+	char *text = NULL;
+	switch (read_comm_reply(&text)) {
+	case COMM_REPLY_NONE:
+		break;
+	case COMM_REPLY_READY:
+		state.auth_ready = true;
+		damage_state(&state);
+		break;
+	case COMM_REPLY_PROMPT:
+		// Waiting on the user is not the backend taking too long
+		cancel_auth_timeout(&state);
+		free(state.auth_prompt);
+		state.auth_prompt = text;
+		state.auth_state = AUTH_STATE_PROMPT;
+		state.input_state = INPUT_STATE_IDLE;
+		damage_state(&state);
+		break;
+	case COMM_REPLY_INFO:
+		swaylock_log(LOG_INFO, "Authentication: %s", text);
+		free(state.auth_message);
+		state.auth_message = text;
+		damage_state(&state);
+		break;
+	case COMM_REPLY_SUCCESS:
 		// Authentication succeeded
 		state.run_display = false;
-	} else {
+		break;
+	case COMM_REPLY_CLOSED:
+		// Avoid spinning on the hung up pipe, further attempts will fail
+		loop_remove_fd(state.eventloop, fd);
+		// fallthrough
+	case COMM_REPLY_FAILURE:
+		cancel_auth_timeout(&state);
+		free(state.auth_prompt);
+		state.auth_prompt = NULL;
 		state.auth_state = AUTH_STATE_INVALID;
 		schedule_auth_idle(&state);
 		++state.failed_attempts;
 		damage_state(&state);
+		break;
 	}
 }
 
 static void term_in(int fd, short mask, void *data) {
-	state.run_display = false;
+	char signals[16];
+	ssize_t amt = read(fd, signals, sizeof(signals));
+	for (ssize_t i = 0; i < amt; ++i) {
+		if (signals[i] == '2') {
+			stats_write(state.args.stats_path ? state.args.stats_path : "-");
+		} else {
+			state.run_display = false;
+		}
+	}
+	if (amt <= 0) {
+		state.run_display = false;
+	}
 }
 
 // Check for --debug 'early' we also apply the correct loglevel
@@ -803,17 +1372,23 @@ void log_init(int argc, char **argv) {
 }
 
 int main(int argc, char **argv) {
+	trace_event("start");
 	log_init(argc, argv);
 	initialize_pw_backend(argc, argv);
+	trace_event("pw_backend_started");
 	srand(time(NULL));
 
 	enum line_mode line_mode = LM_LINE;
 	state.failed_attempts = 0;
 	state.args = (struct swaylock_args){
+		.timer_slack = 50,
 		.ignore_empty = true,
 		.show_indicator = true,
 		.indicator_idle_visible = false,
 		.radius = 50,
+		.indicator_buffers = 3,
+		.animation_duration = 150,
+		.animation_budget = 4000,
 		.thickness = 10,
 		.indicator_x_position = -1,
 		.indicator_y_position = -1,
@@ -856,6 +1431,10 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	trace_open(state.args.trace_path);
+	trace_event("options_parsed");
+	clock_init(&state);
+
 	state.password.len = 0;
 	state.password.buffer_len = 1024;
 	state.password.buffer = password_buffer_create(state.password.buffer_len);
@@ -873,6 +1452,9 @@ int main(int argc, char **argv) {
 	}
 
 	wl_list_init(&state.surfaces);
+	wl_list_init(&state.backgrounds);
+	wl_list_init(&state.indicator_groups);
+	wl_list_init(&state.fonts);
 	state.xkb.context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
 	state.display = wl_display_connect(NULL);
 	if (!state.display) {
@@ -882,7 +1464,10 @@ int main(int argc, char **argv) {
 				"WAYLAND_DISPLAY environment variable.");
 		return EXIT_FAILURE;
 	}
+	trace_event("connected");
 	state.eventloop = loop_create();
+	state.workers = worker_pool_create(state.eventloop,
+			worker_pool_default_size());
 
 	struct wl_registry *registry = wl_display_get_registry(state.display);
 	wl_registry_add_listener(registry, &registry_listener, &state);
@@ -910,33 +1495,83 @@ int main(int argc, char **argv) {
 		swaylock_log(LOG_ERROR, "Missing ext-session-lock-v1");
 		return 1;
 	}
+	trace_event("globals_bound");
+
+#if HAVE_IMAGE_COPY_CAPTURE
+	if (state.args.screenshots && (!state.output_capture_source_manager ||
+			!state.image_copy_capture_manager)) {
+		swaylock_log(LOG_ERROR, "Missing ext-image-copy-capture-v1, "
+			"showing images instead of screenshots");
+		state.args.screenshots = false;
+	}
+	if (state.args.screenshots) {
+		// The outputs send their names now, which starts capturing each of
+		// them. All captures have to be done before the lock hides what is
+		// on the outputs.
+		if (wl_display_roundtrip(state.display) == -1) {
+			swaylock_log(LOG_ERROR, "wl_display_roundtrip() failed");
+			return EXIT_FAILURE;
+		}
+		// A compositor that never finishes a capture must not keep the
+		// session from being locked
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		int64_t deadline = (int64_t)now.tv_sec * 1000 +
+			now.tv_nsec / 1000000 + SCREENSHOT_TIMEOUT_MS;
+		while (screenshots_pending()) {
+			wl_display_flush(state.display);
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			int64_t remaining = deadline - ((int64_t)now.tv_sec * 1000 +
+				now.tv_nsec / 1000000);
+			struct pollfd pfd = {
+				.fd = wl_display_get_fd(state.display),
+				.events = POLLIN,
+			};
+			if (remaining <= 0 || poll(&pfd, 1, remaining) <= 0) {
+				swaylock_log(LOG_ERROR, "Timed out capturing the outputs");
+				screenshots_cancel();
+				break;
+			}
+			if (wl_display_dispatch(state.display) < 0) {
+				swaylock_log(LOG_ERROR, "wl_display_dispatch() failed");
+				return EXIT_FAILURE;
+			}
+		}
+		trace_event("screenshots_captured");
+	}
+#endif
 
 	state.ext_session_lock_v1 = ext_session_lock_manager_v1_lock(state.ext_session_lock_manager_v1);
 	ext_session_lock_v1_add_listener(state.ext_session_lock_v1,
 		&ext_session_lock_v1_listener, &state);
+	trace_event("lock_requested");
 
 	if (wl_display_roundtrip(state.display) == -1) {
 		free(state.args.font);
 		return 1;
 	}
 
-	state.test_surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, 1, 1);
-	state.test_cairo = cairo_create(state.test_surface);
-
 	struct swaylock_surface *surface;
 	wl_list_for_each(surface, &state.surfaces, link) {
 		create_surface(surface);
 	}
 
+	// Backgrounds rendered by the workers are shown from the event loop, so
+	// it already runs while waiting for the lock
+	loop_add_fd(state.eventloop, wl_display_get_fd(state.display), POLLIN, display_in, NULL);
 	while (!state.locked) {
-		if (wl_display_dispatch(state.display) < 0) {
+		errno = 0;
+		if (wl_display_flush(state.display) == -1 && errno != EAGAIN) {
+			swaylock_log_errno(LOG_ERROR, "wl_display_flush() failed");
+			return 2;
+		}
+		loop_poll(state.eventloop);
+		if (wl_display_get_error(state.display) != 0) {
 			swaylock_log(LOG_ERROR, "wl_display_dispatch() failed");
 			return 2;
 		}
 	}
 
-	loop_add_fd(state.eventloop, wl_display_get_fd(state.display), POLLIN, display_in, NULL);
-
 	loop_add_fd(state.eventloop, get_comm_reply_fd(), POLLIN, comm_in, NULL);
 
 	loop_add_fd(state.eventloop, sigusr_fds[0], POLLIN, term_in, NULL);
@@ -946,9 +1581,16 @@ int main(int argc, char **argv) {
 	sigemptyset(&sa.sa_mask);
 	sa.sa_flags = SA_RESTART;
 	sigaction(SIGUSR1, &sa, NULL);
+	// Dumps the frame stats
+	sigaction(SIGUSR2, &sa, NULL);
+
+	schedule_clock(&state);
 
 	state.run_display = true;
 	while (state.run_display) {
+		// All events of the last iteration have been handled, draw their
+		// result at most once
+		flush_state_damage(&state);
 		errno = 0;
 		if (wl_display_flush(state.display) == -1 && errno != EAGAIN) {
 			break;
@@ -958,9 +1600,16 @@ int main(int argc, char **argv) {
 
 	ext_session_lock_v1_unlock_and_destroy(state.ext_session_lock_v1);
 	wl_display_roundtrip(state.display);
+	trace_event("unlocked");
+	trace_close();
+	if (state.args.stats_path) {
+		stats_write(state.args.stats_path);
+	}
+	stats_destroy();
 
 	free(state.args.font);
-	cairo_destroy(state.test_cairo);
-	cairo_surface_destroy(state.test_surface);
+	free(state.args.effects);
+	destroy_fonts(&state);
+	clock_finish();
 	return 0;
 }
@@ -1,16 +1,20 @@
 #define _POSIX_C_SOURCE 200809L
+#include <grp.h>
 #include <pwd.h>
 #include <security/pam_appl.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include "comm.h"
 #include "log.h"
 #include "password-buffer.h"
 #include "swaylock.h"
 
+// The password of the check in progress, until it answered a prompt
 static char *pw_buf = NULL;
+static size_t pw_size = 0;
 
 void initialize_pw_backend(int argc, char **argv) {
 	if (getuid() != geteuid() || getgid() != getegid()) {
@@ -24,6 +28,27 @@ void initialize_pw_backend(int argc, char **argv) {
 	}
 }
 
+// Answers a prompt: the password entered first answers the first prompt of
+// a check, further prompts (e.g. for a second factor) are shown by the UI.
+static char *get_prompt_answer(const char *prompt) {
+	if (pw_buf) {
+		char *answer = strdup(pw_buf); // PAM clears and frees this
+		password_buffer_destroy(pw_buf, pw_size);
+		pw_buf = NULL;
+		return answer;
+	}
+
+	char *buf;
+	ssize_t size = read_comm_response(prompt, &buf);
+	if (size <= 0) {
+		swaylock_log(LOG_DEBUG, "Prompt '%s' was not answered", prompt);
+		return NULL;
+	}
+	char *answer = strdup(buf);
+	password_buffer_destroy(buf, size);
+	return answer;
+}
+
 static int handle_conversation(int num_msg, const struct pam_message **msg,
 		struct pam_response **resp, void *data) {
 	/* PAM expects an array of responses, one for each message */
@@ -33,22 +58,31 @@ static int handle_conversation(int num_msg, const struct pam_message **msg,
 		swaylock_log(LOG_ERROR, "Allocation failed");
 		return PAM_ABORT;
 	}
-	*resp = pam_reply;
 	for (int i = 0; i < num_msg; ++i) {
 		switch (msg[i]->msg_style) {
 		case PAM_PROMPT_ECHO_OFF:
 		case PAM_PROMPT_ECHO_ON:
-			pam_reply[i].resp = strdup(pw_buf); // PAM clears and frees this
+			pam_reply[i].resp = get_prompt_answer(msg[i]->msg);
 			if (pam_reply[i].resp == NULL) {
-				swaylock_log(LOG_ERROR, "Allocation failed");
-				return PAM_ABORT;
+				// PAM doesn't free the replies of a failed conversation
+				for (int j = 0; j < i; ++j) {
+					if (pam_reply[j].resp) {
+						clear_buffer(pam_reply[j].resp,
+							strlen(pam_reply[j].resp));
+						free(pam_reply[j].resp);
+					}
+				}
+				free(pam_reply);
+				return PAM_CONV_ERR;
 			}
 			break;
 		case PAM_ERROR_MSG:
 		case PAM_TEXT_INFO:
+			write_comm_info(msg[i]->msg);
 			break;
 		}
 	}
+	*resp = pam_reply;
 	return PAM_SUCCESS;
 }
 
@@ -70,6 +104,31 @@ static const char *get_pam_auth_error(int pam_status) {
 	}
 }
 
+// pam_start has loaded the modules of the stack already, but network backed
+// ones only look the user up on the first pam_authenticate. Do the lookups
+// now, so NSS backends like sssd have their connection open and the user
+// cached by the time a password is entered.
+static void prewarm_user_lookups(uid_t uid) {
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	struct passwd *passwd = getpwuid(uid);
+	if (passwd) {
+		char *username = strdup(passwd->pw_name);
+		gid_t gid = passwd->pw_gid;
+		if (username) {
+			getpwnam(username);
+			free(username);
+		}
+		getgrgid(gid);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	swaylock_log(LOG_DEBUG, "Warmed up user lookups in %ld ms",
+		(long)(end.tv_sec - start.tv_sec) * 1000 +
+		(end.tv_nsec - start.tv_nsec) / 1000000);
+}
+
 void run_pw_backend_child(void) {
 	struct passwd *passwd = getpwuid(getuid());
 	char *username = passwd->pw_name;
@@ -87,6 +146,11 @@ void run_pw_backend_child(void) {
 	/* This code does not run as root */
 	swaylock_log(LOG_DEBUG, "Prepared to authorize user %s", username);
 
+	prewarm_user_lookups(getuid());
+	if (!write_comm_ready()) {
+		exit(EXIT_FAILURE);
+	}
+
 	int pam_status = PAM_SUCCESS;
 	while (1) {
 		ssize_t size = read_comm_request(&pw_buf);
@@ -95,10 +159,13 @@ void run_pw_backend_child(void) {
 		} else if (size == 0) {
 			break;
 		}
+		pw_size = size;
 
 		int pam_status = pam_authenticate(auth_handle, 0);
-		password_buffer_destroy(pw_buf, size);
-		pw_buf = NULL;
+		if (pw_buf) {
+			password_buffer_destroy(pw_buf, pw_size);
+			pw_buf = NULL;
+		}
 
 		bool success = pam_status == PAM_SUCCESS;
 		if (!success) {
@@ -1,8 +1,10 @@
+#define _POSIX_C_SOURCE 200809L
 #include <assert.h>
 #include <errno.h>
 #include <pwd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <xkbcommon/xkbcommon.h>
 #include "comm.h"
@@ -56,16 +58,34 @@ static void set_input_idle(void *data) {
 static void set_auth_idle(void *data) {
 	struct swaylock_state *state = data;
 	state->auth_idle_timer = NULL;
+	if (state->auth_state == AUTH_STATE_PROMPT) {
+		// A later attempt is waiting for an answer
+		return;
+	}
 	state->auth_state = AUTH_STATE_IDLE;
+	clear_auth_texts(state);
 	damage_state(state);
 }
 
+void clear_auth_texts(struct swaylock_state *state) {
+	free(state->auth_prompt);
+	state->auth_prompt = NULL;
+	free(state->auth_message);
+	state->auth_message = NULL;
+}
+
+static void cancel_auth_prompt(struct swaylock_state *state) {
+	cancel_comm_request();
+	clear_auth_texts(state);
+	state->auth_state = AUTH_STATE_IDLE;
+}
+
 static void schedule_input_idle(struct swaylock_state *state) {
 	if (state->input_idle_timer) {
 		loop_remove_timer(state->eventloop, state->input_idle_timer);
 	}
-	state->input_idle_timer = loop_add_timer(
-		state->eventloop, 1500, set_input_idle, state);
+	state->input_idle_timer = loop_add_timer_slack(state->eventloop,
+		1500, state->args.timer_slack, set_input_idle, state);
 }
 
 static void cancel_input_idle(struct swaylock_state *state) {
@@ -79,8 +99,8 @@ void schedule_auth_idle(struct swaylock_state *state) {
 	if (state->auth_idle_timer) {
 		loop_remove_timer(state->eventloop, state->auth_idle_timer);
 	}
-	state->auth_idle_timer = loop_add_timer(
-		state->eventloop, 3000, set_auth_idle, state);
+	state->auth_idle_timer = loop_add_timer_slack(state->eventloop,
+		3000, state->args.timer_slack, set_auth_idle, state);
 }
 
 static void clear_password(void *data) {
@@ -96,8 +116,8 @@ static void schedule_password_clear(struct swaylock_state *state) {
 	if (state->clear_password_timer) {
 		loop_remove_timer(state->eventloop, state->clear_password_timer);
 	}
-	state->clear_password_timer = loop_add_timer(
-			state->eventloop, 10000, clear_password, state);
+	state->clear_password_timer = loop_add_timer_slack(state->eventloop,
+			10000, state->args.timer_slack, clear_password, state);
 }
 
 static void cancel_password_clear(struct swaylock_state *state) {
@@ -107,17 +127,58 @@ static void cancel_password_clear(struct swaylock_state *state) {
 	}
 }
 
+static void auth_timeout(void *data) {
+	struct swaylock_state *state = data;
+	state->auth_timeout_timer = NULL;
+	swaylock_log(LOG_ERROR, "Password check timed out after %d seconds",
+		state->args.auth_timeout);
+	cancel_comm_request();
+	free(state->auth_prompt);
+	state->auth_prompt = NULL;
+	state->auth_state = AUTH_STATE_INVALID;
+	schedule_auth_idle(state);
+	damage_state(state);
+}
+
+static void schedule_auth_timeout(struct swaylock_state *state) {
+	cancel_auth_timeout(state);
+	if (state->args.auth_timeout > 0) {
+		state->auth_timeout_timer = loop_add_timer(state->eventloop,
+			state->args.auth_timeout * 1000, auth_timeout, state);
+	}
+}
+
+void cancel_auth_timeout(struct swaylock_state *state) {
+	if (state->auth_timeout_timer) {
+		loop_remove_timer(state->eventloop, state->auth_timeout_timer);
+		state->auth_timeout_timer = NULL;
+	}
+}
+
 static void submit_password(struct swaylock_state *state) {
 	if (state->args.ignore_empty && state->password.len == 0) {
 		return;
 	}
 
+	// Either the answer to a prompt of the pending check, or a new check
+	// superseding the pending one
+	bool answer = state->auth_state == AUTH_STATE_PROMPT;
 	state->input_state = INPUT_STATE_IDLE;
 	state->auth_state = AUTH_STATE_VALIDATING;
 	cancel_password_clear(state);
 	cancel_input_idle(state);
+	if (answer) {
+		free(state->auth_prompt);
+		state->auth_prompt = NULL;
+	} else {
+		clear_auth_texts(state);
+	}
 
-	if (!write_comm_request(&state->password)) {
+	if (answer ? write_comm_response(&state->password) :
+			write_comm_request(&state->password)) {
+		schedule_auth_timeout(state);
+	} else {
+		cancel_auth_timeout(state);
 		state->auth_state = AUTH_STATE_INVALID;
 		schedule_auth_idle(state);
 	}
@@ -126,13 +187,15 @@ static void submit_password(struct swaylock_state *state) {
 }
 
 static void update_highlight(struct swaylock_state *state) {
-	// Advance a random amount between 1/4 and 3/4 of a full turn
-	state->highlight_start =
-		(state->highlight_start + (rand() % 1024) + 512) % 2048;
+	// Moved once per batch of keys, see flush_state_damage
+	state->highlight_pending = true;
 }
 
 void swaylock_handle_key(struct swaylock_state *state,
 		xkb_keysym_t keysym, uint32_t codepoint) {
+	if (state->key_time.tv_sec == 0 && state->key_time.tv_nsec == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &state->key_time);
+	}
 
 	switch (keysym) {
 	case XKB_KEY_KP_Enter: /* fallthrough */
@@ -159,6 +222,10 @@ void swaylock_handle_key(struct swaylock_state *state,
 		damage_state(state);
 		break;
 	case XKB_KEY_Escape:
+		if (state->auth_state == AUTH_STATE_PROMPT) {
+			// Gives up on the check, the next password starts over
+			cancel_auth_prompt(state);
+		}
 		clear_password_buffer(&state->password);
 		state->input_state = INPUT_STATE_CLEAR;
 		cancel_password_clear(state);
@@ -10,7 +10,11 @@
 #include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
+#include "config.h"
 #include "pool-buffer.h"
+#if HAVE_DMABUF
+#include "dmabuf.h"
+#endif
 
 static int anonymous_shm_open(void) {
 	int retries = 100;
@@ -49,9 +53,35 @@ static const struct wl_buffer_listener buffer_listener = {
 struct pool_buffer *create_buffer(struct wl_shm *shm,
 		struct pool_buffer *buf, int32_t width, int32_t height,
 		uint32_t format) {
+#if HAVE_DMABUF
+	if (width > 0 && height > 0) {
+		void *data;
+		uint32_t stride;
+		buf->dmabuf = dmabuf_buffer_create(width, height, format,
+			&buf->buffer, &data, &stride);
+		if (buf->dmabuf) {
+			wl_buffer_add_listener(buf->buffer, &buffer_listener, buf);
+			buf->size = (size_t)stride * height;
+			buf->width = width;
+			buf->height = height;
+			buf->stride = stride;
+			buf->data = data;
+			buf->surface = cairo_image_surface_create_for_data(data,
+					CAIRO_FORMAT_ARGB32, width, height, stride);
+			buf->cairo = cairo_create(buf->surface);
+			return buf;
+		}
+	}
+#endif
+
+	return create_shm_buffer(shm, buf, width, height, format);
+}
+
+struct pool_buffer *create_shm_buffer(struct wl_shm *shm,
+		struct pool_buffer *buf, int32_t width, int32_t height,
+		uint32_t format) {
 	uint32_t stride = width * 4;
 	size_t size = stride * height;
-
 	void *data = NULL;
 	if (size > 0) {
 		int fd = anonymous_shm_open();
@@ -74,6 +104,7 @@ struct pool_buffer *create_buffer(struct wl_shm *shm,
 	buf->size = size;
 	buf->width = width;
 	buf->height = height;
+	buf->stride = stride;
 	buf->data = data;
 	buf->surface = cairo_image_surface_create_for_data(data,
 			CAIRO_FORMAT_ARGB32, width, height, stride);
@@ -81,47 +112,223 @@ struct pool_buffer *create_buffer(struct wl_shm *shm,
 	return buf;
 }
 
-void destroy_buffer(struct pool_buffer *buffer) {
-	if (buffer->buffer) {
-		wl_buffer_destroy(buffer->buffer);
+struct pool_buffer *create_buffer_from_fd(struct wl_shm *shm,
+		struct pool_buffer *buf, int fd, size_t size, int32_t offset,
+		int32_t width, int32_t height, int32_t stride, uint32_t format) {
+	struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
+	buf->buffer = wl_shm_pool_create_buffer(pool, offset,
+			width, height, stride, format);
+	wl_buffer_add_listener(buf->buffer, &buffer_listener, buf);
+	wl_shm_pool_destroy(pool);
+
+	buf->size = 0;
+	buf->width = width;
+	buf->height = height;
+	buf->stride = stride;
+	buf->data = NULL;
+	buf->surface = NULL;
+	buf->cairo = NULL;
+	return buf;
+}
+
+// Offsets of buffers in an arena are kept aligned to cache lines
+#define ARENA_ALIGNMENT 64
+
+struct shm_arena {
+	struct wl_shm *shm;
+	struct wl_shm_pool *pool;
+	int fd;
+	void *data;
+	size_t size;
+	struct wl_list buffers; // struct pool_buffer::link
+};
+
+struct shm_arena *shm_arena_create(struct wl_shm *shm) {
+	struct shm_arena *arena = calloc(1, sizeof(*arena));
+	if (!arena) {
+		return NULL;
 	}
+	arena->shm = shm;
+	arena->fd = -1;
+	wl_list_init(&arena->buffers);
+	return arena;
+}
+
+void shm_arena_destroy(struct shm_arena *arena) {
+	assert(wl_list_empty(&arena->buffers));
+	if (arena->pool) {
+		wl_shm_pool_destroy(arena->pool);
+	}
+	if (arena->data) {
+		munmap(arena->data, arena->size);
+	}
+	if (arena->fd != -1) {
+		close(arena->fd);
+	}
+	free(arena);
+}
+
+static bool arena_range_is_free(struct shm_arena *arena,
+		size_t offset, size_t size) {
+	struct pool_buffer *buffer;
+	wl_list_for_each(buffer, &arena->buffers, link) {
+		if (offset < buffer->offset + buffer->size &&
+				buffer->offset < offset + size) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// First offset where `size` bytes fit between or after the live buffers
+static size_t arena_find_offset(struct shm_arena *arena, size_t size) {
+	size_t best = 0;
+	bool found = arena_range_is_free(arena, 0, size) && size <= arena->size;
+	size_t end = 0;
+	struct pool_buffer *buffer;
+	wl_list_for_each(buffer, &arena->buffers, link) {
+		size_t offset = buffer->offset + buffer->size;
+		offset = (offset + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+		if (offset > end) {
+			end = offset;
+		}
+		if (offset + size <= arena->size &&
+				arena_range_is_free(arena, offset, size) &&
+				(!found || offset < best)) {
+			best = offset;
+			found = true;
+		}
+	}
+	return found ? best : end;
+}
+
+static void arena_map_buffer(struct pool_buffer *buffer) {
 	if (buffer->cairo) {
 		cairo_destroy(buffer->cairo);
-	}
-	if (buffer->surface) {
 		cairo_surface_destroy(buffer->surface);
 	}
-	if (buffer->data) {
-		munmap(buffer->data, buffer->size);
-	}
-	memset(buffer, 0, sizeof(struct pool_buffer));
+	buffer->data = (char *)buffer->arena->data + buffer->offset;
+	buffer->surface = cairo_image_surface_create_for_data(buffer->data,
+			CAIRO_FORMAT_ARGB32, buffer->width, buffer->height,
+			buffer->stride);
+	buffer->cairo = cairo_create(buffer->surface);
 }
 
-struct pool_buffer *get_next_buffer(struct wl_shm *shm,
-		struct pool_buffer pool[static 2], uint32_t width, uint32_t height) {
-	struct pool_buffer *buffer = NULL;
+static bool arena_grow(struct shm_arena *arena, size_t size) {
+	// Grow by half again at least, so a few size changes in a row don't
+	// resize the pool every time
+	if (size < arena->size + arena->size / 2) {
+		size = arena->size + arena->size / 2;
+	}
 
-	for (size_t i = 0; i < 2; ++i) {
-		if (pool[i].busy) {
-			continue;
+	if (arena->fd == -1) {
+		arena->fd = anonymous_shm_open();
+		if (arena->fd == -1) {
+			return false;
 		}
-		buffer = &pool[i];
 	}
+	if (ftruncate(arena->fd, size) < 0) {
+		return false;
+	}
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		arena->fd, 0);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+	if (arena->data) {
+		munmap(arena->data, arena->size);
+	}
+	arena->data = data;
+
+	if (arena->pool) {
+		wl_shm_pool_resize(arena->pool, size);
+	} else {
+		arena->pool = wl_shm_create_pool(arena->shm, arena->fd, size);
+	}
+	arena->size = size;
+
+	// The mapping moved, and the cairo surfaces with it
+	struct pool_buffer *buffer;
+	wl_list_for_each(buffer, &arena->buffers, link) {
+		arena_map_buffer(buffer);
+	}
+	return true;
+}
+
+struct pool_buffer *create_arena_buffer(struct shm_arena *arena,
+		struct pool_buffer *buf, int32_t width, int32_t height,
+		uint32_t format) {
+	uint32_t stride = width * 4;
+	size_t size = stride * height;
 
-	if (!buffer) {
+	size_t offset = arena_find_offset(arena, size);
+	if (offset + size > arena->size && !arena_grow(arena, offset + size)) {
 		return NULL;
 	}
 
-	if (buffer->width != width || buffer->height != height) {
-		destroy_buffer(buffer);
+	buf->buffer = wl_shm_pool_create_buffer(arena->pool, offset,
+			width, height, stride, format);
+	wl_buffer_add_listener(buf->buffer, &buffer_listener, buf);
+
+	buf->size = size;
+	buf->width = width;
+	buf->height = height;
+	buf->stride = stride;
+	buf->arena = arena;
+	buf->offset = offset;
+	buf->cairo = NULL;
+	buf->surface = NULL;
+	arena_map_buffer(buf);
+	wl_list_insert(&arena->buffers, &buf->link);
+	return buf;
+}
+
+void finish_buffer(struct pool_buffer *buffer) {
+	if (buffer->surface) {
+		cairo_surface_flush(buffer->surface);
+	}
+#if HAVE_DMABUF
+	if (buffer->dmabuf) {
+		dmabuf_buffer_finish(buffer->dmabuf);
 	}
+#endif
+}
 
-	if (!buffer->buffer) {
-		if (!create_buffer(shm, buffer, width, height,
-					WL_SHM_FORMAT_ARGB8888)) {
-			return NULL;
-		}
+void begin_buffer_read(const struct pool_buffer *buffer) {
+#if HAVE_DMABUF
+	if (buffer->dmabuf) {
+		dmabuf_buffer_begin_read(buffer->dmabuf);
+	}
+#endif
+}
+
+void end_buffer_read(const struct pool_buffer *buffer) {
+#if HAVE_DMABUF
+	if (buffer->dmabuf) {
+		dmabuf_buffer_end_read(buffer->dmabuf);
 	}
-	buffer->busy = true;
-	return buffer;
+#endif
+}
+
+void destroy_buffer(struct pool_buffer *buffer) {
+	if (buffer->buffer) {
+		wl_buffer_destroy(buffer->buffer);
+	}
+	if (buffer->cairo) {
+		cairo_destroy(buffer->cairo);
+	}
+	if (buffer->surface) {
+		cairo_surface_destroy(buffer->surface);
+	}
+	if (buffer->arena) {
+		// The pixels belong to the arena mapping
+		wl_list_remove(&buffer->link);
+#if HAVE_DMABUF
+	} else if (buffer->dmabuf) {
+		dmabuf_buffer_destroy(buffer->dmabuf);
+#endif
+	} else if (buffer->data) {
+		munmap(buffer->data, buffer->size);
+	}
+	memset(buffer, 0, sizeof(struct pool_buffer));
 }
@@ -1,127 +1,1160 @@
+#define _POSIX_C_SOURCE 200809L
+#include <inttypes.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
-#include <locale.h>
 #include <wayland-client.h>
 #include "cairo.h"
+#include "clock.h"
+#include "background-cache.h"
 #include "background-image.h"
+#include "effects.h"
 #include "swaylock.h"
 #include "log.h"
+#include "stats.h"
+#include "trace.h"
+#include "worker.h"
+#include "single-pixel-buffer-v1-client-protocol.h"
+#include "viewporter-client-protocol.h"
 
 #define M_PI 3.14159265358979323846
 const float TYPE_INDICATOR_RANGE = M_PI / 3.0f;
 const float TYPE_INDICATOR_BORDER_THICKNESS = M_PI / 128.0f;
 
-static uint32_t get_font_size(struct swaylock_state *state, int arc_radius) {
-	if (state->args.font_size > 0) {
-		return state->args.font_size;
-	} else {
-		return arc_radius / 3.0f;
+// Number of backgrounds no surface is displaying that are kept in the cache,
+// or as many as there have been outputs at once if that is more, so
+// unplugging all of them and plugging them back in renders nothing
+#define MAX_UNUSED_BACKGROUNDS 2
+
+static void destroy_background(struct swaylock_background *background) {
+	wl_list_remove(&background->link);
+	destroy_buffer(&background->buffer);
+	if (background->source) {
+		cairo_surface_destroy(background->source);
 	}
+	free(background);
 }
 
-void render_frame_background(struct swaylock_surface *surface) {
+static void prune_backgrounds(struct swaylock_state *state) {
+	// The list is kept in most recently used order, so the unused entries
+	// furthest back are the ones that get dropped
+	int unused = 0;
+	int max_unused = state->max_surfaces > MAX_UNUSED_BACKGROUNDS ?
+		state->max_surfaces : MAX_UNUSED_BACKGROUNDS;
+	struct swaylock_background *background, *tmp;
+	wl_list_for_each_safe(background, tmp, &state->backgrounds, link) {
+		if (background->refs > 0) {
+			continue;
+		}
+		if (++unused > max_unused) {
+			destroy_background(background);
+		}
+	}
+}
+
+void release_background(struct swaylock_state *state,
+		struct swaylock_background *background) {
+	if (--background->refs == 0) {
+		prune_backgrounds(state);
+	}
+}
+
+static bool background_matches(struct swaylock_background *background,
+		struct swaylock_image *image, enum background_mode mode,
+		int buffer_width, int buffer_height) {
+	if (background->image != image || background->mode != mode ||
+			background->width != buffer_width ||
+			background->height != buffer_height) {
+		return false;
+	}
+	// Images get decoded again when a larger output shows up, anything
+	// rendered from a previous version too small for the buffer is out of
+	// date
+	return !background->source || background->complete ||
+		background->source == image->cairo_surface;
+}
+
+// Whether the image was decoded at (at least) the size of the buffer
+static bool image_covers_buffer(struct swaylock_image *image,
+		int buffer_width, int buffer_height) {
+	if (image->load_width == 0 && image->load_height == 0) {
+		return true;
+	}
+	return buffer_width <= image->load_width &&
+		buffer_height <= image->load_height;
+}
+
+static char *get_background_cache_key(struct swaylock_state *state,
+		struct swaylock_image *image, int buffer_width, int buffer_height) {
+	if (!state->args.cache_backgrounds || !image || !image->path) {
+		return NULL;
+	}
+	char *effects = describe_effects(state->args.effects,
+		state->args.effects_count);
+	if (!effects) {
+		return NULL;
+	}
+	char *key = background_cache_key(image->path, state->args.mode,
+		state->args.colors.background, effects, buffer_width, buffer_height);
+	free(effects);
+	return key;
+}
+
+struct background_store {
+	struct swaylock_state *state;
+	struct swaylock_background *background;
+	char *key;
+};
+
+static void background_store_work(void *data) {
+	struct background_store *store = data;
+	const struct pool_buffer *buffer = &store->background->buffer;
+	begin_buffer_read(buffer);
+	background_cache_store(store->key, buffer);
+	end_buffer_read(buffer);
+}
+
+static void background_store_done(void *data) {
+	struct background_store *store = data;
+	release_background(store->state, store->background);
+	free(store->key);
+	free(store);
+}
+
+// Writes the background to the disk cache in the background, keeping it
+// alive until that is done
+static void store_background(struct swaylock_state *state,
+		struct swaylock_background *background, char *key) {
+	struct background_store *store = calloc(1, sizeof(struct background_store));
+	if (!store || !state->workers) {
+		free(store);
+		free(key);
+		return;
+	}
+	store->state = state;
+	store->background = background;
+	store->key = key;
+	++background->refs;
+	if (!worker_pool_submit(state->workers,
+				background_store_work, background_store_done, store)) {
+		background_store_done(store);
+	}
+}
+
+static void draw_background(const struct swaylock_args *args,
+		struct swaylock_background *background) {
+	cairo_t *cairo = background->buffer.cairo;
+	cairo_set_antialias(cairo, CAIRO_ANTIALIAS_BEST);
+
+	cairo_save(cairo);
+	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_u32(cairo, args->colors.background);
+	cairo_paint(cairo);
+	if (background->source) {
+		cairo_set_operator(cairo, CAIRO_OPERATOR_OVER);
+		render_background_image(cairo, background->source, background->mode,
+			background->width, background->height);
+		// At the size of the buffer, so they look the same on every output
+		// no matter the size of the image
+		apply_effects(cairo_get_target(cairo), args->effects,
+			args->effects_count);
+	}
+	cairo_restore(cairo);
+	cairo_identity_matrix(cairo);
+}
+
+struct background_render {
+	struct swaylock_state *state;
+	struct swaylock_background *background;
+	char *key; // to store the background under when done, if any
+};
+
+// Only the pixels of the buffer are touched here, the rest of the background
+// stays the same while it is being rendered
+static void background_render_work(void *data) {
+	struct background_render *render = data;
+	draw_background(&render->state->args, render->background);
+}
+
+static void background_render_done(void *data) {
+	struct background_render *render = data;
+	struct swaylock_state *state = render->state;
+	struct swaylock_background *background = render->background;
+	char *key = render->key;
+	free(render);
+
+	finish_buffer(&background->buffer);
+	background->rendering = false;
+	if (key) {
+		store_background(state, background, key);
+	}
+
+	struct swaylock_surface *surface;
+	wl_list_for_each(surface, &state->surfaces, link) {
+		if (surface->pending_background == background) {
+			render_frame_background(surface);
+		}
+	}
+	release_background(state, background);
+}
+
+bool background_is_cached(struct swaylock_state *state,
+		struct swaylock_image *image, int buffer_width, int buffer_height) {
+	struct swaylock_background *background;
+	wl_list_for_each(background, &state->backgrounds, link) {
+		if (background_matches(background, image, state->args.mode,
+					buffer_width, buffer_height)) {
+			return true;
+		}
+	}
+
+	char *key = get_background_cache_key(state, image,
+		buffer_width, buffer_height);
+	bool cached = key &&
+		background_cache_contains(key, buffer_width, buffer_height);
+	free(key);
+	return cached;
+}
+
+static uint32_t premultiplied_channel(uint32_t color, int shift) {
+	double alpha = (color & 0xFF) / 255.0;
+	double value = ((color >> shift) & 0xFF) / 255.0 * alpha;
+	return round(value * UINT32_MAX);
+}
+
+static void create_single_pixel_buffer(struct swaylock_state *state,
+		struct pool_buffer *buffer) {
+	uint32_t color = state->args.colors.background;
+	buffer->buffer = wp_single_pixel_buffer_manager_v1_create_u32_rgba_buffer(
+		state->single_pixel_buffer_manager,
+		premultiplied_channel(color, 24), premultiplied_channel(color, 16),
+		premultiplied_channel(color, 8), premultiplied_channel(color, 0));
+	buffer->width = 1;
+	buffer->height = 1;
+}
+
+static struct swaylock_background *get_background(struct swaylock_state *state,
+		struct output_stats *stats, struct swaylock_image *image,
+		int buffer_width, int buffer_height) {
+	enum background_mode mode = state->args.mode;
+
+	struct swaylock_background *background;
+	wl_list_for_each(background, &state->backgrounds, link) {
+		if (background_matches(background, image, mode,
+					buffer_width, buffer_height)) {
+			wl_list_remove(&background->link);
+			wl_list_insert(&state->backgrounds, &background->link);
+			++background->refs;
+			stats_count_path(stats, STATS_BACKGROUND_SHARED);
+			return background;
+		}
+	}
+
+	char *key = get_background_cache_key(state, image,
+		buffer_width, buffer_height);
+	cairo_surface_t *source = image ? image->cairo_surface : NULL;
+
+	background = calloc(1, sizeof(struct swaylock_background));
+	if (!background) {
+		swaylock_log(LOG_ERROR, "Unable to allocate memory for background");
+		free(key);
+		return NULL;
+	}
+	background->image = image;
+	background->mode = mode;
+	background->width = buffer_width;
+	background->height = buffer_height;
+	background->refs = 1;
+
+	if (key && background_cache_load(state->shm, key,
+				buffer_width, buffer_height, &background->buffer)) {
+		swaylock_log(LOG_DEBUG, "Using cached background for %s", image->path);
+		free(key);
+		wl_list_insert(&state->backgrounds, &background->link);
+		stats_count_path(stats, STATS_BACKGROUND_DISK_CACHE);
+		return background;
+	}
+
+	if (image && !source) {
+		// Not decoded yet, the caller falls back to the background color
+		free(key);
+		free(background);
+		schedule_image_load(state, image);
+		return NULL;
+	}
+
+	if (!image && buffer_width == 1 && buffer_height == 1 &&
+			state->single_pixel_buffer_manager) {
+		create_single_pixel_buffer(state, &background->buffer);
+		wl_list_insert(&state->backgrounds, &background->link);
+		stats_count_path(stats, STATS_BACKGROUND_SOLID);
+		return background;
+	}
+
+	if (!create_buffer(state->shm, &background->buffer, buffer_width,
+				buffer_height, WL_SHM_FORMAT_ARGB8888)) {
+		swaylock_log(LOG_ERROR, "Failed to create new buffer for frame background.");
+		free(key);
+		free(background);
+		return NULL;
+	}
+	stats_count_path(stats, STATS_BACKGROUND_RENDERED);
+	stats_count_allocation(stats, background->buffer.size);
+
+	// Hold on to the decoded image, so its address can't be reused for a
+	// newer version while this is in the cache
+	background->source = source ? cairo_surface_reference(source) : NULL;
+	background->complete = image &&
+		image_covers_buffer(image, buffer_width, buffer_height);
+	wl_list_insert(&state->backgrounds, &background->link);
+	if (key && !background->complete) {
+		free(key);
+		key = NULL;
+	}
+
+	// Filling the buffer with the background color is quicker than handing
+	// it to a worker, and shows up on the first configure
+	struct background_render *render = source ?
+		calloc(1, sizeof(*render)) : NULL;
+	if (render && state->workers) {
+		render->state = state;
+		render->background = background;
+		render->key = key;
+		background->rendering = true;
+		++background->refs;
+		if (worker_pool_submit(state->workers,
+					background_render_work, background_render_done, render)) {
+			return background;
+		}
+		background->rendering = false;
+		--background->refs;
+	}
+	free(render);
+
+	draw_background(&state->args, background);
+	finish_buffer(&background->buffer);
+	if (key) {
+		store_background(state, background, key);
+	}
+	return background;
+}
+
+// Outputs with a fractional scale get buffers of their exact size in pixels,
+// which viewports map back onto the surfaces. Integer scales keep using the
+// buffer scale.
+static bool surface_is_fractional(struct swaylock_surface *surface) {
+	return surface->state->viewporter && surface->fractional_scale % 120 != 0;
+}
+
+// With --compositor-scaling, images that would be scaled up to fill the
+// output are rendered at the size of the part that is shown instead, and the
+// compositor scales them the rest of the way. Returns whether the size of
+// the buffer changed.
+static bool get_compositor_scaled_size(struct swaylock_state *state,
+		struct swaylock_image *image, int *width, int *height) {
+	if (!state->args.compositor_scaling || !state->viewporter ||
+			!image->cairo_surface) {
+		return false;
+	}
+	double image_width = cairo_image_surface_get_width(image->cairo_surface);
+	double image_height = cairo_image_surface_get_height(image->cairo_surface);
+
+	int scaled_width = *width, scaled_height = *height;
+	switch (state->args.mode) {
+	case BACKGROUND_MODE_STRETCH:
+		scaled_width = fmin(scaled_width, image_width);
+		scaled_height = fmin(scaled_height, image_height);
+		break;
+	case BACKGROUND_MODE_FILL: {
+		double scale = fmax(*width / image_width, *height / image_height);
+		if (scale <= 1) {
+			return false;
+		}
+		scaled_width = fmax(round(*width / scale), 1);
+		scaled_height = fmax(round(*height / scale), 1);
+		break;
+	}
+	default:
+		return false;
+	}
+	if (scaled_width == *width && scaled_height == *height) {
+		return false;
+	}
+	*width = scaled_width;
+	*height = scaled_height;
+	return true;
+}
+
+// Backgrounds still being rendered by a worker get shown once they're done.
+// When the fallback is still rendering as well, only the first one counts.
+static struct swaylock_background *wait_for_background(
+		struct swaylock_surface *surface,
+		struct swaylock_background *background) {
+	if (background && background->rendering) {
+		if (!surface->pending_background) {
+			surface->pending_background = background;
+		}
+		release_background(surface->state, background);
+		return NULL;
+	}
+	return background;
+}
+
+static void update_background(struct swaylock_surface *surface) {
 	struct swaylock_state *state = surface->state;
+	surface->pending_background = NULL;
 
-	int buffer_width = surface->width * surface->scale;
-	int buffer_height = surface->height * surface->scale;
+	bool fractional = surface_is_fractional(surface);
+	int buffer_width, buffer_height;
+	if (fractional) {
+		double scale = surface->fractional_scale / 120.0;
+		buffer_width = round(surface->width * scale);
+		buffer_height = round(surface->height * scale);
+	} else {
+		buffer_width = surface->width * surface->scale;
+		buffer_height = surface->height * surface->scale;
+	}
 	if (buffer_width == 0 || buffer_height == 0) {
 		return; // not yet configured
 	}
 
-	wl_surface_set_buffer_scale(surface->surface, surface->scale);
+	struct swaylock_image *image = NULL;
+	if (state->args.mode != BACKGROUND_MODE_SOLID_COLOR) {
+		image = surface->image;
+	}
 
-	if (buffer_width != surface->last_buffer_width ||
-			buffer_height != surface->last_buffer_height) {
-		struct pool_buffer buffer;
-		if (!create_buffer(state->shm, &buffer, buffer_width, buffer_height, WL_SHM_FORMAT_ARGB8888)) {
-			swaylock_log(LOG_ERROR, "Failed to create new buffer for frame background.");
-			return;
+	struct swaylock_background *old = surface->background;
+	struct swaylock_background *background = NULL;
+	bool stretch = false;
+	if (image) {
+		int width = buffer_width, height = buffer_height;
+		stretch = get_compositor_scaled_size(state, image, &width, &height);
+		if (old && background_matches(old, image, state->args.mode,
+					width, height)) {
+			background = old;
+			stats_count_path(surface->stats, STATS_BACKGROUND_REUSED);
+		} else {
+			background = wait_for_background(surface, get_background(state,
+				surface->stats, image, width, height));
 		}
+	}
 
-		cairo_t *cairo = buffer.cairo;
-		cairo_set_antialias(cairo, CAIRO_ANTIALIAS_BEST);
-
-		cairo_save(cairo);
-		cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
-		cairo_set_source_u32(cairo, state->args.colors.background);
-		cairo_paint(cairo);
-		if (surface->image && state->args.mode != BACKGROUND_MODE_SOLID_COLOR) {
-			cairo_set_operator(cairo, CAIRO_OPERATOR_OVER);
-			render_background_image(cairo, surface->image,
-				state->args.mode, buffer_width, buffer_height);
+	// Solid colors, which images that are still being decoded or rendered
+	// show until they are ready as well, are a single pixel stretched over
+	// the surface when the compositor can do that
+	if (!background) {
+		stretch = false;
+		if (state->viewporter) {
+			buffer_width = buffer_height = 1;
+			stretch = true;
 		}
-		cairo_restore(cairo);
-		cairo_identity_matrix(cairo);
+		if (old && background_matches(old, NULL, state->args.mode,
+					buffer_width, buffer_height)) {
+			background = old;
+			stats_count_path(surface->stats, STATS_BACKGROUND_REUSED);
+		} else {
+			background = wait_for_background(surface, get_background(state,
+				surface->stats, NULL, buffer_width, buffer_height));
+		}
+	}
+	if (!background) {
+		stats_count_dropped_frame(surface->stats);
+		return;
+	}
 
-		wl_surface_attach(surface->surface, buffer.buffer, 0, 0);
-		wl_surface_damage_buffer(surface->surface, 0, 0, INT32_MAX, INT32_MAX);
-		wl_surface_commit(surface->surface);
-		destroy_buffer(&buffer);
+	int32_t buffer_scale = stretch || fractional ? 0 : surface->scale;
+	if (background == old && buffer_scale == surface->background_scale &&
+			surface->width == surface->background_width &&
+			surface->height == surface->background_height) {
+		// The compositor already shows exactly this
+		return;
+	}
 
-		surface->last_buffer_width = buffer_width;
-		surface->last_buffer_height = buffer_height;
+	if (stretch || fractional) {
+		if (!surface->viewport) {
+			surface->viewport = wp_viewporter_get_viewport(state->viewporter,
+				surface->surface);
+		}
+		wl_surface_set_buffer_scale(surface->surface, 1);
+		wp_viewport_set_destination(surface->viewport,
+			surface->width, surface->height);
 	} else {
-		wl_surface_commit(surface->surface);
+		wl_surface_set_buffer_scale(surface->surface, surface->scale);
+		if (surface->viewport) {
+			wp_viewport_set_destination(surface->viewport, -1, -1);
+		}
+	}
+
+	if (background != old) {
+		wl_surface_attach(surface->surface, background->buffer.buffer, 0, 0);
+		wl_surface_damage_buffer(surface->surface, 0, 0, INT32_MAX, INT32_MAX);
+		surface->background = background;
+		if (old) {
+			release_background(state, old);
+		}
 	}
+	surface->background_scale = buffer_scale;
+	surface->background_width = surface->width;
+	surface->background_height = surface->height;
+	wl_surface_commit(surface->surface);
+	trace_output_event(&surface->traced, TRACE_BACKGROUND_COMMIT,
+		surface->output_name);
 }
 
-static void configure_font_drawing(cairo_t *cairo, struct swaylock_state *state,
-		enum wl_output_subpixel subpixel, int arc_radius) {
+void render_frame_background(struct swaylock_surface *surface) {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	update_background(surface);
+	stats_record_time(surface->stats, STATS_RENDER_BACKGROUND, &start);
+}
+
+// The font of the text at one size and subpixel layout. Looking it up goes
+// through fontconfig, so it is only done once and shared by all indicators.
+// The font name can't change while running, so it isn't part of the key.
+struct swaylock_font {
+	double size;
+	enum wl_output_subpixel subpixel;
+	cairo_scaled_font_t *scaled_font;
+	cairo_font_extents_t extents;
+	struct wl_list link; // struct swaylock_state::fonts
+};
+
+static struct swaylock_font *get_font(struct swaylock_state *state,
+		double size, enum wl_output_subpixel subpixel) {
+	struct swaylock_font *font;
+	wl_list_for_each(font, &state->fonts, link) {
+		if (font->size == size && font->subpixel == subpixel) {
+			return font;
+		}
+	}
+
+	font = calloc(1, sizeof(*font));
+	if (!font) {
+		swaylock_log(LOG_ERROR, "Failed to allocate font");
+		return NULL;
+	}
+	font->size = size;
+	font->subpixel = subpixel;
+
+	cairo_font_face_t *face = cairo_toy_font_face_create(state->args.font,
+		CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
 	cairo_font_options_t *fo = cairo_font_options_create();
 	cairo_font_options_set_hint_style(fo, CAIRO_HINT_STYLE_FULL);
 	cairo_font_options_set_antialias(fo, CAIRO_ANTIALIAS_SUBPIXEL);
 	cairo_font_options_set_subpixel_order(fo, to_cairo_subpixel_order(subpixel));
+	cairo_matrix_t font_matrix, ctm;
+	cairo_matrix_init_scale(&font_matrix, size, size);
+	cairo_matrix_init_identity(&ctm);
+	font->scaled_font = cairo_scaled_font_create(face, &font_matrix, &ctm, fo);
+	cairo_font_options_destroy(fo);
+	cairo_font_face_destroy(face);
 
-	cairo_set_font_options(cairo, fo);
-	cairo_select_font_face(cairo, state->args.font,
-		CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
-	if (state->args.font_size > 0) {
-		cairo_set_font_size(cairo, state->args.font_size);
-	} else {
-		cairo_set_font_size(cairo, arc_radius / 3.0f);
+	if (cairo_scaled_font_status(font->scaled_font) != CAIRO_STATUS_SUCCESS) {
+		swaylock_log(LOG_ERROR, "Failed to load font %s", state->args.font);
+		cairo_scaled_font_destroy(font->scaled_font);
+		free(font);
+		return NULL;
 	}
-	cairo_font_options_destroy(fo);
+	cairo_scaled_font_extents(font->scaled_font, &font->extents);
+	wl_list_insert(&state->fonts, &font->link);
+	return font;
 }
 
-static void timetext(struct swaylock_surface *surface, char **tstr, char **dstr) {
-	static char dbuf[256];
-	static char tbuf[256];
+void destroy_fonts(struct swaylock_state *state) {
+	struct swaylock_font *font, *tmp;
+	wl_list_for_each_safe(font, tmp, &state->fonts, link) {
+		wl_list_remove(&font->link);
+		cairo_scaled_font_destroy(font->scaled_font);
+		free(font);
+	}
+}
 
-	// Use user's locale for strftime calls
-	char *prevloc = setlocale(LC_TIME, NULL);
-	setlocale(LC_TIME, "");
+// A line of text, laid out again only when it changes
+struct text_line {
+	char *text;
+	struct swaylock_font *font;
+	cairo_glyph_t *glyphs; // positioned in the text layer
+	int num_glyphs;
+	cairo_rectangle_int_t bounds; // ink extents, in buffer pixels
+};
 
-	time_t t = time(NULL);
-	struct tm *tm = localtime(&t);
+// Animated frames in a row taking longer than --animation-budget before the
+// animation is skipped
+#define MAX_FRAMES_OVER_BUDGET 2
 
-	if (surface->state->args.timestr[0]) {
-		strftime(tbuf, sizeof(tbuf), surface->state->args.timestr, tm);
-		*tstr = tbuf;
-	} else {
-		*tstr = NULL;
+// Number of indicator groups no surface uses that are kept around
+#define MAX_UNUSED_INDICATORS 2
+
+struct indicator_buffer {
+	struct pool_buffer buffer;
+	struct indicator_frame frame; // what was last drawn into the buffer
+	struct wl_list link; // struct indicator_group::buffers
+};
+
+// The indicator of all outputs with the same scale and subpixel layout looks
+// the same, so it is rendered once for all of them and the same wl_buffer is
+// attached to each of their child surfaces.
+//
+// The parts that only change with the state are rendered once into layers,
+// which are composited into the indicator buffer on every frame. Only the
+// typing highlight is stroked live.
+struct indicator_group {
+	double scale;
+	enum wl_output_subpixel subpixel;
+	int width, height;
+	int arc_radius, arc_thickness, diameter;
+	int refs; // surfaces showing the indicator
+
+	struct shm_arena *arena;
+	struct wl_list buffers; // struct indicator_buffer::link
+	int buffer_count;
+	struct indicator_buffer *current; // most recently rendered
+
+	cairo_surface_t *ring;
+	// Inner and outer border, one per color they have been drawn in. The
+	// least recently used one is replaced once all are taken, never the ones
+	// an animation is fading between.
+	struct {
+		uint32_t color;
+		cairo_surface_t *surface;
+		uint32_t used; // border_uses when last painted
+	} borders[4];
+	uint32_t border_uses;
+
+	// The clock, redrawn when its text changes
+	cairo_surface_t *text;
+	cairo_t *text_cairo;
+	uint32_t text_serial;
+	struct text_line lines[2];
+	cairo_rectangle_int_t text_bounds;
+
+	struct wl_list link; // struct swaylock_state::indicator_groups
+};
+
+static void rect_union(cairo_rectangle_int_t *dest,
+		const cairo_rectangle_int_t *rect) {
+	if (rect->width <= 0 || rect->height <= 0) {
+		return;
+	}
+	if (dest->width <= 0 || dest->height <= 0) {
+		*dest = *rect;
+		return;
+	}
+	int x1 = dest->x < rect->x ? dest->x : rect->x;
+	int y1 = dest->y < rect->y ? dest->y : rect->y;
+	int x2 = dest->x + dest->width;
+	if (rect->x + rect->width > x2) {
+		x2 = rect->x + rect->width;
+	}
+	int y2 = dest->y + dest->height;
+	if (rect->y + rect->height > y2) {
+		y2 = rect->y + rect->height;
+	}
+	*dest = (cairo_rectangle_int_t){ x1, y1, x2 - x1, y2 - y1 };
+}
+
+static void destroy_indicator_group(struct indicator_group *group) {
+	wl_list_remove(&group->link);
+	struct indicator_buffer *buffer, *tmp;
+	wl_list_for_each_safe(buffer, tmp, &group->buffers, link) {
+		destroy_buffer(&buffer->buffer);
+		free(buffer);
+	}
+	shm_arena_destroy(group->arena);
+	cairo_surface_destroy(group->ring);
+	for (size_t i = 0; i < sizeof(group->borders) / sizeof(group->borders[0]); ++i) {
+		if (group->borders[i].surface) {
+			cairo_surface_destroy(group->borders[i].surface);
+		}
+	}
+	cairo_destroy(group->text_cairo);
+	cairo_surface_destroy(group->text);
+	for (size_t i = 0; i < sizeof(group->lines) / sizeof(group->lines[0]); ++i) {
+		free(group->lines[i].text);
+		cairo_glyph_free(group->lines[i].glyphs);
+	}
+	free(group);
+}
+
+static void prune_indicator_groups(struct swaylock_state *state) {
+	int unused = 0;
+	int max_unused = state->max_surfaces > MAX_UNUSED_INDICATORS ?
+		state->max_surfaces : MAX_UNUSED_INDICATORS;
+	struct indicator_group *group, *tmp;
+	wl_list_for_each_safe(group, tmp, &state->indicator_groups, link) {
+		if (group->refs > 0) {
+			continue;
+		}
+		if (++unused > max_unused) {
+			destroy_indicator_group(group);
+		}
+	}
+}
+
+static cairo_t *create_layer(struct indicator_group *group,
+		cairo_surface_t **surface) {
+	*surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+		group->width, group->height);
+	cairo_t *cairo = cairo_create(*surface);
+	cairo_set_antialias(cairo, CAIRO_ANTIALIAS_BEST);
+	return cairo;
+}
+
+static struct indicator_group *get_indicator_group(
+		struct swaylock_state *state, double scale,
+		enum wl_output_subpixel subpixel, int width, int height) {
+	struct indicator_group *group;
+	wl_list_for_each(group, &state->indicator_groups, link) {
+		if (group->scale == scale && group->subpixel == subpixel &&
+				group->width == width && group->height == height) {
+			// Keep the list in most recently used order
+			wl_list_remove(&group->link);
+			wl_list_insert(&state->indicator_groups, &group->link);
+			return group;
+		}
+	}
+
+	group = calloc(1, sizeof(*group));
+	if (!group) {
+		swaylock_log(LOG_ERROR, "Failed to allocate indicator");
+		return NULL;
+	}
+	group->scale = scale;
+	group->subpixel = subpixel;
+	group->width = width;
+	group->height = height;
+	group->arc_radius = state->args.radius * scale;
+	group->arc_thickness = state->args.thickness * scale;
+	group->diameter = (group->arc_radius + group->arc_thickness) * 2;
+	wl_list_init(&group->buffers);
+	group->arena = shm_arena_create(state->shm);
+	if (!group->arena) {
+		swaylock_log(LOG_ERROR, "Failed to allocate indicator");
+		free(group);
+		return NULL;
+	}
+
+	cairo_t *cairo = create_layer(group, &group->ring);
+	cairo_set_line_width(cairo, group->arc_thickness);
+	cairo_arc(cairo, width / 2, group->diameter / 2, group->arc_radius,
+		0, 2 * M_PI);
+	cairo_set_source_u32(cairo, state->args.colors.ring);
+	cairo_stroke(cairo);
+	cairo_destroy(cairo);
+	cairo_surface_flush(group->ring);
+
+	group->text_cairo = create_layer(group, &group->text);
+	cairo_set_source_u32(group->text_cairo, state->args.colors.text);
+	double font_size = state->args.font_size > 0 ?
+		state->args.font_size : group->arc_radius / 3.0f;
+	group->lines[0].font = get_font(state, font_size, subpixel);
+	group->lines[1].font = get_font(state, group->arc_radius / 6.0f, subpixel);
+
+	wl_list_insert(&state->indicator_groups, &group->link);
+	return group;
+}
+
+// Whether two frames only differ in their clock text
+static bool indicator_frame_matches(const struct indicator_frame *a,
+		const struct indicator_frame *b) {
+	return a->valid && b->valid &&
+		a->draw_indicator == b->draw_indicator &&
+		a->auth_state == b->auth_state &&
+		a->auth_ready == b->auth_ready &&
+		a->input_state == b->input_state &&
+		a->opacity == b->opacity &&
+		a->border_from == b->border_from &&
+		a->border_to == b->border_to &&
+		a->border_progress == b->border_progress &&
+		a->highlight_color == b->highlight_color &&
+		a->highlight_start == b->highlight_start &&
+		a->subpixel == b->subpixel && a->scale == b->scale &&
+		a->width == b->width && a->height == b->height;
+}
+
+// Returns a buffer of the group no surface or the compositor is using,
+// preferring one which only needs its clock text redrawn for the frame
+static struct indicator_buffer *get_indicator_buffer(
+		struct swaylock_state *state, struct output_stats *stats,
+		struct indicator_group *group, const struct indicator_frame *next) {
+	struct indicator_buffer *buffer, *tmp, *found = NULL;
+	wl_list_for_each(buffer, &group->buffers, link) {
+		if (buffer->buffer.busy || buffer->buffer.users > 0) {
+			continue;
+		}
+		if (!found || indicator_frame_matches(&buffer->frame, next)) {
+			found = buffer;
+		}
+	}
+
+	// Buffers added while outputs showing older frames held on to the
+	// others are dropped again once they are free
+	wl_list_for_each_safe(buffer, tmp, &group->buffers, link) {
+		if (group->buffer_count <= state->args.indicator_buffers) {
+			break;
+		}
+		if (buffer == found || buffer == group->current ||
+				buffer->buffer.busy || buffer->buffer.users > 0) {
+			continue;
+		}
+		wl_list_remove(&buffer->link);
+		destroy_buffer(&buffer->buffer);
+		free(buffer);
+		group->buffer_count--;
+	}
+
+	if (found) {
+		found->buffer.busy = true;
+		return found;
+	}
+
+	buffer = calloc(1, sizeof(*buffer));
+	if (!buffer) {
+		swaylock_log(LOG_ERROR, "Failed to allocate indicator buffer");
+		return NULL;
+	}
+	if (!create_arena_buffer(group->arena, &buffer->buffer, group->width,
+				group->height, WL_SHM_FORMAT_ARGB8888)) {
+		free(buffer);
+		return NULL;
+	}
+	stats_count_allocation(stats, buffer->buffer.size);
+	buffer->buffer.busy = true;
+	wl_list_insert(&group->buffers, &buffer->link);
+	group->buffer_count++;
+	if (group->buffer_count > state->args.indicator_buffers) {
+		swaylock_log(LOG_DEBUG, "All %d indicator buffers are in use, "
+			"adding another", group->buffer_count - 1);
+	}
+	return buffer;
+}
+
+static cairo_surface_t *get_border_layer(struct indicator_group *group,
+		uint32_t color, double scale) {
+	size_t count = sizeof(group->borders) / sizeof(group->borders[0]);
+	size_t slot = 0;
+	++group->border_uses;
+	for (size_t i = 0; i < count; ++i) {
+		if (!group->borders[i].surface) {
+			slot = i;
+			break;
+		}
+		if (group->borders[i].color == color) {
+			group->borders[i].used = group->border_uses;
+			return group->borders[i].surface;
+		}
+		if (group->borders[i].used < group->borders[slot].used) {
+			slot = i;
+		}
+	}
+	if (group->borders[slot].surface) {
+		cairo_surface_destroy(group->borders[slot].surface);
+	}
+
+	cairo_surface_t *surface;
+	cairo_t *cairo = create_layer(group, &surface);
+	cairo_set_source_u32(cairo, color);
+	cairo_set_line_width(cairo, 2.0 * scale);
+	cairo_arc(cairo, group->width / 2, group->diameter / 2,
+			group->arc_radius - group->arc_thickness / 2, 0, 2 * M_PI);
+	cairo_stroke(cairo);
+	cairo_arc(cairo, group->width / 2, group->diameter / 2,
+			group->arc_radius + group->arc_thickness / 2, 0, 2 * M_PI);
+	cairo_stroke(cairo);
+	cairo_destroy(cairo);
+	cairo_surface_flush(surface);
+
+	group->borders[slot].color = color;
+	group->borders[slot].surface = surface;
+	group->borders[slot].used = group->border_uses;
+	return surface;
+}
+
+static void layout_text_line(struct text_line *line, const char *text,
+		int buffer_width, int buffer_diameter, double y_offset) {
+	free(line->text);
+	cairo_glyph_free(line->glyphs);
+	line->text = text ? strdup(text) : NULL;
+	line->glyphs = NULL;
+	line->num_glyphs = 0;
+	line->bounds = (cairo_rectangle_int_t){ 0 };
+	if (!line->text || !line->font) {
+		return;
+	}
+
+	cairo_scaled_font_t *scaled_font = line->font->scaled_font;
+	if (cairo_scaled_font_text_to_glyphs(scaled_font, 0, 0, line->text, -1,
+				&line->glyphs, &line->num_glyphs, NULL, NULL, NULL) !=
+			CAIRO_STATUS_SUCCESS) {
+		swaylock_log(LOG_ERROR, "Failed to convert text to glyphs");
+		line->glyphs = NULL;
+		line->num_glyphs = 0;
+		return;
+	}
+	cairo_text_extents_t extents;
+	cairo_scaled_font_glyph_extents(scaled_font, line->glyphs,
+		line->num_glyphs, &extents);
+	const cairo_font_extents_t *fe = &line->font->extents;
+	double x = (buffer_width / 2) - (extents.width / 2 + extents.x_bearing);
+	double y = (buffer_diameter / 2) + (fe->height / 2 - fe->descent) + y_offset;
+	for (int i = 0; i < line->num_glyphs; ++i) {
+		line->glyphs[i].x += x;
+		line->glyphs[i].y += y;
+	}
+
+	// Leave some room for antialiasing and hinting
+	line->bounds.x = floor(x + extents.x_bearing) - 2;
+	line->bounds.y = floor(y + extents.y_bearing) - 2;
+	line->bounds.width = ceil(extents.width) + 5;
+	line->bounds.height = ceil(extents.height) + 5;
+}
+
+static bool text_equal(const char *a, const char *b) {
+	return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+static void update_text_layer(struct indicator_group *group,
+		const char *text_l1, const char *text_l2) {
+	struct text_line *line1 = &group->lines[0];
+	struct text_line *line2 = &group->lines[1];
+	bool line1_changed = !text_equal(line1->text, text_l1);
+	bool line2_changed = !text_equal(line2->text, text_l2);
+	if (!line1_changed && !line2_changed) {
+		return;
 	}
+	cairo_t *cairo = group->text_cairo;
+
+	cairo_rectangle_int_t *old = &group->text_bounds;
+	if (old->width > 0 && old->height > 0) {
+		cairo_save(cairo);
+		cairo_set_operator(cairo, CAIRO_OPERATOR_CLEAR);
+		cairo_rectangle(cairo, old->x, old->y, old->width, old->height);
+		cairo_fill(cairo);
+		cairo_restore(cairo);
+	}
+	group->text_bounds = (cairo_rectangle_int_t){ 0 };
+
+	group->text_serial++;
 
-	if (surface->state->args.datestr[0]) {
-		strftime(dbuf, sizeof(dbuf), surface->state->args.datestr, tm);
-		*dstr = dbuf;
+	// The line that stays the same, usually the date, keeps its glyphs
+	if (line1_changed) {
+		layout_text_line(line1, text_l1, group->width, group->diameter,
+			-group->arc_radius / 10.0f);
+	}
+	if (line2_changed) {
+		layout_text_line(line2, text_l2, group->width, group->diameter,
+			group->arc_radius / 3.5f);
+	}
+
+	for (size_t i = 0; i < sizeof(group->lines) / sizeof(group->lines[0]); ++i) {
+		struct text_line *line = &group->lines[i];
+		if (line->glyphs == NULL) {
+			continue;
+		}
+		cairo_set_scaled_font(cairo, line->font->scaled_font);
+		cairo_show_glyphs(cairo, line->glyphs, line->num_glyphs);
+		rect_union(&group->text_bounds, &line->bounds);
+	}
+	cairo_surface_flush(group->text);
+}
+
+static void paint_layer(cairo_t *cairo, cairo_surface_t *layer,
+		const cairo_rectangle_int_t *rect) {
+	cairo_set_source_surface(cairo, layer, 0, 0);
+	if (rect) {
+		cairo_rectangle(cairo, rect->x, rect->y, rect->width, rect->height);
+		cairo_fill(cairo);
 	} else {
-		*dstr = NULL;
+		cairo_paint(cairo);
+	}
+}
+
+static void render_indicator(struct swaylock_state *state,
+		struct indicator_group *group, struct indicator_buffer *buffer,
+		const struct indicator_frame *next) {
+	cairo_t *cairo = buffer->buffer.cairo;
+	cairo_set_antialias(cairo, CAIRO_ANTIALIAS_BEST);
+
+	cairo_identity_matrix(cairo);
+
+	// When only the clock changed only its old and new text need drawing
+	bool partial = indicator_frame_matches(&buffer->frame, next);
+	if (partial) {
+		cairo_rectangle_int_t clip = next->text;
+		rect_union(&clip, &buffer->frame.text);
+
+		cairo_save(cairo);
+		cairo_rectangle(cairo, clip.x, clip.y, clip.width, clip.height);
+		cairo_clip(cairo);
+	}
+
+	// Clear
+	cairo_save(cairo);
+	cairo_set_source_rgba(cairo, 0, 0, 0, 0);
+	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+	cairo_paint(cairo);
+	cairo_restore(cairo);
+
+	if (next->draw_indicator) {
+		// Fading in or out, everything is drawn at once with the opacity
+		bool faded = next->opacity < TRANSITION_DONE;
+		if (faded) {
+			cairo_push_group(cairo);
+		}
+
+		// Draw ring and message
+		paint_layer(cairo, group->ring, NULL);
+		if (next->text.width > 0 && next->text.height > 0) {
+			paint_layer(cairo, group->text, &next->text);
+		}
+
+		// Typing indicator: Highlight random part on keypress
+		if (next->highlight_color != 0) {
+			double highlight_start = next->highlight_start * (M_PI / 1024.0);
+			cairo_set_line_width(cairo, group->arc_thickness);
+			cairo_arc(cairo, group->width / 2, group->diameter / 2, group->arc_radius, highlight_start, highlight_start + TYPE_INDICATOR_RANGE);
+			cairo_set_source_u32(cairo, next->highlight_color);
+			cairo_stroke(cairo);
+		}
+
+		// Draw inner + outer border of the circle, the new color faded in
+		// over the old one
+		if (next->border_progress < TRANSITION_DONE && next->border_from != 0) {
+			paint_layer(cairo, get_border_layer(group, next->border_from,
+				group->scale), NULL);
+		}
+		if (next->border_to != 0) {
+			cairo_set_source_surface(cairo, get_border_layer(group,
+				next->border_to, group->scale), 0, 0);
+			cairo_paint_with_alpha(cairo,
+				next->border_progress / (double)TRANSITION_DONE);
+		}
+
+		if (faded) {
+			cairo_pop_group_to_source(cairo);
+			cairo_paint_with_alpha(cairo,
+				next->opacity / (double)TRANSITION_DONE);
+		}
+	}
+	else {
+		swaylock_log(LOG_INFO, "Not drawing indicator...");
 	}
 
-	// Set it back, so we don't break stuff
-	setlocale(LC_TIME, prevloc);
+	if (partial) {
+		cairo_restore(cairo);
+	}
+	buffer->frame = *next;
 }
 
-void render_frame(struct swaylock_surface *surface) {
+static uint32_t get_border_color(struct swaylock_state *state) {
+	if (state->input_state == INPUT_STATE_CLEAR) {
+		return state->args.colors.highlight_clear;
+	} else if (state->auth_state == AUTH_STATE_VALIDATING ||
+			(!state->auth_ready &&
+			 state->auth_state != AUTH_STATE_INVALID)) {
+		// Until the backend is ready, checks are slow as well
+		return state->args.colors.highlight_ver;
+	} else if (state->auth_state == AUTH_STATE_INVALID) {
+		return state->args.colors.highlight_wrong;
+	}
+	return state->args.colors.ring;
+}
+
+static uint32_t lerp(uint32_t from, uint32_t to, uint8_t progress) {
+	return from + ((int64_t)to - from) * progress / TRANSITION_DONE;
+}
+
+// The highlight only ever moves forward around the ring
+static uint32_t lerp_angle(uint32_t from, uint32_t to, uint8_t progress) {
+	return (from + (to - from) % 2048 * progress / TRANSITION_DONE) % 2048;
+}
+
+// Moves the animation of the indicator towards what the state looks like,
+// and puts where it is at into the frame
+static void animate_indicator(struct swaylock_state *state,
+		bool draw_indicator, struct indicator_frame *next) {
+	struct indicator_animation *animation = &state->animation;
+	int duration = state->args.animation_duration;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	uint32_t highlight_color = 0;
+	if (state->input_state == INPUT_STATE_LETTER) {
+		highlight_color = state->args.colors.highlight_key;
+	} else if (state->input_state == INPUT_STATE_BACKSPACE) {
+		highlight_color = state->args.colors.highlight_bs;
+	}
+
+	// Changes start from what was just shown
+	struct transition *t = &animation->opacity;
+	uint8_t progress = transition_progress(t, &now, duration);
+	transition_set(t, lerp(t->from, t->to, progress),
+		draw_indicator ? TRANSITION_DONE : 0, &now, duration);
+
+	// Borders are layers faded into each other, the one mostly shown
+	// is faded out
+	t = &animation->border;
+	progress = transition_progress(t, &now, duration);
+	transition_set(t, progress < TRANSITION_DONE / 2 ? t->from : t->to,
+		get_border_color(state), &now, duration);
+
+	t = &animation->highlight_color;
+	progress = transition_progress(t, &now, duration);
+	uint32_t shown = blend_colors(t->from, t->to, progress);
+	transition_set(t, shown, highlight_color, &now, duration);
+
+	// A highlight that isn't visible yet shows up where it is going to
+	t = &animation->highlight_angle;
+	progress = transition_progress(t, &now, duration);
+	transition_set(t, lerp_angle(t->from, t->to, progress),
+		state->highlight_start, &now, shown == 0 ? 0 : duration);
+
+	t = &animation->opacity;
+	progress = transition_progress(t, &now, duration);
+	next->opacity = lerp(t->from, t->to, progress);
+	bool animating = progress < TRANSITION_DONE;
+	if (next->opacity == 0 && !animating) {
+		// Nothing to see of the rest
+		animation_finish(animation);
+	}
+
+	t = &animation->border;
+	next->border_progress = transition_progress(t, &now, duration);
+	next->border_from = t->from;
+	next->border_to = t->to;
+	animating |= next->border_progress < TRANSITION_DONE;
+
+	t = &animation->highlight_color;
+	progress = transition_progress(t, &now, duration);
+	next->highlight_color = blend_colors(t->from, t->to, progress);
+	animating |= progress < TRANSITION_DONE;
+
+	t = &animation->highlight_angle;
+	progress = transition_progress(t, &now, duration);
+	next->highlight_start = lerp_angle(t->from, t->to, progress);
+	animating |= progress < TRANSITION_DONE;
+
+	next->draw_indicator = next->opacity > 0;
+	next->animating = animating;
+}
+
+static void update_indicator(struct swaylock_surface *surface) {
 	struct swaylock_state *state = surface->state;
 	// First, compute the text that will be drawn, if any, since this
 	// determines the size/positioning of the surface
 
-	char *text_l1 = NULL;
-	char *text_l2 = NULL;
+	const char *text_l1 = NULL;
+	const char *text_l2 = NULL;
 	if (state->args.clock) {
-		timetext(surface, &text_l1, &text_l2);
+		clock_get_text(&text_l1, &text_l2);
+	}
+	// Prompts and messages of the check take the place of the clock
+	if (state->auth_prompt) {
+		text_l1 = state->auth_prompt;
+		text_l2 = state->auth_message;
+	} else if (state->auth_message) {
+		text_l2 = state->auth_message;
 	}
 	
 	bool draw_indicator = state->args.show_indicator &&
@@ -130,26 +1163,37 @@ void render_frame(struct swaylock_surface *surface) {
 			state->args.indicator_idle_visible);
 
 	// Compute the size of the buffer needed
-	int arc_radius = state->args.radius * surface->scale;
-	int arc_thickness = state->args.thickness * surface->scale;
+	bool fractional = surface_is_fractional(surface);
+	double scale = fractional ?
+		surface->fractional_scale / 120.0 : surface->scale;
+	int arc_radius = state->args.radius * scale;
+	int arc_thickness = state->args.thickness * scale;
 	int buffer_diameter = (arc_radius + arc_thickness) * 2;
 	int buffer_width = buffer_diameter;
 	int buffer_height = buffer_diameter;
 
-	// Ensure buffer size is multiple of buffer scale - required by protocol
-	buffer_height += surface->scale - (buffer_height % surface->scale);
-	buffer_width += surface->scale - (buffer_width % surface->scale);
+	// The size of the subsurface, in surface coordinates
+	int indicator_size = (state->args.radius + state->args.thickness) * 2 + 1;
+	int x_offset;
+	if (fractional) {
+		// Exactly what the subsurface covers on the output
+		buffer_width = buffer_height = round(indicator_size * scale);
+		x_offset = indicator_size / 2;
+	} else {
+		// Ensure buffer size is multiple of buffer scale - required by protocol
+		buffer_height += surface->scale - (buffer_height % surface->scale);
+		buffer_width += surface->scale - (buffer_width % surface->scale);
+		x_offset = buffer_width / (2 * surface->scale) - 2 / surface->scale;
+	}
 
 	int subsurf_xpos;
 	int subsurf_ypos;
 
 	// Center the indicator unless overridden by the user
 	if (state->args.indicator_x_position >= 0) {
-		subsurf_xpos = state->args.indicator_x_position -
-			buffer_width / (2 * surface->scale) + 2 / surface->scale;
+		subsurf_xpos = state->args.indicator_x_position - x_offset;
 	} else {
-		subsurf_xpos = surface->width / 2 -
-			buffer_width / (2 * surface->scale) + 2 / surface->scale;
+		subsurf_xpos = surface->width / 2 - x_offset;
 	}
 
 	if (state->args.indicator_y_position >= 0) {
@@ -160,115 +1204,139 @@ void render_frame(struct swaylock_surface *surface) {
 			(state->args.radius + state->args.thickness);
 	}
 
-	struct pool_buffer *buffer = get_next_buffer(state->shm,
-			surface->indicator_buffers, buffer_width, buffer_height);
-	if (buffer == NULL) {
+	struct indicator_group *group = get_indicator_group(state, scale,
+		surface->subpixel, buffer_width, buffer_height);
+	if (group == NULL) {
 		return;
 	}
+	if (surface->indicator != group) {
+		release_indicator(surface);
+		surface->indicator = group;
+		group->refs++;
+	}
 
-	// Render the buffer
-	cairo_t *cairo = buffer->cairo;
-	cairo_set_antialias(cairo, CAIRO_ANTIALIAS_BEST);
-
-	cairo_identity_matrix(cairo);
-
-	// Clear
-	cairo_save(cairo);
-	cairo_set_source_rgba(cairo, 0, 0, 0, 0);
-	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
-	cairo_paint(cairo);
-	cairo_restore(cairo);
-	
-	if (draw_indicator) {
-		// Draw ring
-		cairo_set_line_width(cairo, arc_thickness);
-		cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2, arc_radius, 0, 2 * M_PI);
-		cairo_set_source_u32(cairo, state->args.colors.ring);
-		cairo_stroke(cairo);
-
-		// Draw message
-		configure_font_drawing(cairo, state, surface->subpixel, arc_radius);
-		cairo_set_source_u32(cairo, state->args.colors.text);
-		
-		cairo_text_extents_t extents_l1, extents_l2;
-		cairo_font_extents_t fe_l1, fe_l2;
-		double x_l1, y_l1, x_l2, y_l2;
-
-		/* First line */
-		if (text_l1 != NULL) {
-			cairo_text_extents(cairo, text_l1, &extents_l1);
-			cairo_font_extents(cairo, &fe_l1);
-			x_l1 = (buffer_width / 2) -
-				(extents_l1.width / 2 + extents_l1.x_bearing);
-			y_l1 = (buffer_diameter / 2) +
-				(fe_l1.height / 2 - fe_l1.descent) - arc_radius / 10.0f;
-
-			cairo_move_to(cairo, x_l1, y_l1);
-			cairo_show_text(cairo, text_l1);
-			cairo_close_path(cairo);
-			cairo_new_sub_path(cairo);
-		}
-
-		/* Second line */
-		if (text_l2 != NULL) {
-			cairo_set_font_size(cairo, arc_radius / 6.0f);
-			cairo_text_extents(cairo, text_l2, &extents_l2);
-			cairo_font_extents(cairo, &fe_l2);
-			x_l2 = (buffer_width / 2) -
-				(extents_l2.width / 2 + extents_l2.x_bearing);
-			y_l2 = (buffer_diameter / 2) +
-				(fe_l2.height / 2 - fe_l2.descent) + arc_radius / 3.5f;
-
-			cairo_move_to(cairo, x_l2, y_l2);
-			cairo_show_text(cairo, text_l2);
-			cairo_close_path(cairo);
-			cairo_new_sub_path(cairo);
-
-			cairo_set_font_size(cairo, get_font_size(state, arc_radius));
-		}
-
-		// Typing indicator: Highlight random part on keypress
-		if (state->input_state == INPUT_STATE_LETTER || state->input_state == INPUT_STATE_BACKSPACE) {
-			double highlight_start = state->highlight_start * (M_PI / 1024.0);
-			cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2, arc_radius, highlight_start, highlight_start + TYPE_INDICATOR_RANGE);
-			if (state->input_state == INPUT_STATE_LETTER) {
-				cairo_set_source_u32(cairo, state->args.colors.highlight_key);
-			} else {
-				cairo_set_source_u32(cairo, state->args.colors.highlight_bs);
-			}
-			cairo_stroke(cairo);
-		}
+	struct indicator_frame next = {
+		.valid = true,
+		.auth_state = state->auth_state,
+		.auth_ready = state->auth_ready,
+		.input_state = state->input_state,
+		.subpixel = surface->subpixel,
+		.scale = scale,
+		.width = buffer_width,
+		.height = buffer_height,
+	};
+	// Still drawn while fading out
+	animate_indicator(state, draw_indicator, &next);
+	if (next.draw_indicator) {
+		update_text_layer(group, text_l1, text_l2);
+		next.text_serial = group->text_serial;
+		next.text = group->text_bounds;
+	}
 
-		// Draw inner + outer border of the circle
-		if (state->input_state == INPUT_STATE_CLEAR) {
-			cairo_set_source_u32(cairo, state->args.colors.highlight_clear);
-		} else if (state->auth_state == AUTH_STATE_VALIDATING) {
-			cairo_set_source_u32(cairo, state->args.colors.highlight_ver);
-		} else if (state->auth_state == AUTH_STATE_INVALID) {
-			cairo_set_source_u32(cairo, state->args.colors.highlight_wrong);
-		} else {
-			cairo_set_source_u32(cairo, state->args.colors.ring);
+	// Another output of the group may have rendered this frame already
+	struct indicator_buffer *current = group->current;
+	if (!current || !indicator_frame_matches(&current->frame, &next) ||
+			current->frame.text_serial != next.text_serial) {
+		current = get_indicator_buffer(state, surface->stats, group, &next);
+		if (current == NULL) {
+			stats_count_dropped_frame(surface->stats);
+			return;
 		}
-
-		cairo_set_line_width(cairo, 2.0 * surface->scale);
-		cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
-				arc_radius - arc_thickness / 2, 0, 2 * M_PI);
-		cairo_stroke(cairo);
-		cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
-				arc_radius + arc_thickness / 2, 0, 2 * M_PI);
-		cairo_stroke(cairo);
+		render_indicator(state, group, current, &next);
+		group->current = current;
+		stats_count_path(surface->stats, STATS_INDICATOR_RENDERED);
+	} else {
+		stats_count_path(surface->stats, STATS_INDICATOR_REUSED);
 	}
-	else {
-		swaylock_log(LOG_INFO, "Not drawing indicator...");
+
+	// When only the clock changed, the frame on screen differs from the new
+	// one in its text alone
+	cairo_rectangle_int_t damage = { 0, 0, buffer_width, buffer_height };
+	if (indicator_frame_matches(&surface->indicator_frame, &next)) {
+		damage = next.text;
+		rect_union(&damage, &surface->indicator_frame.text);
 	}
+	surface->indicator_frame = next;
 
 	// Send Wayland requests
 	wl_subsurface_set_position(surface->subsurface, subsurf_xpos, subsurf_ypos);
 
-	wl_surface_set_buffer_scale(surface->child, surface->scale);
-	wl_surface_attach(surface->child, buffer->buffer, 0, 0);
-	wl_surface_damage_buffer(surface->child, 0, 0, INT32_MAX, INT32_MAX);
+	if (fractional) {
+		if (!surface->child_viewport) {
+			surface->child_viewport = wp_viewporter_get_viewport(
+				state->viewporter, surface->child);
+		}
+		wl_surface_set_buffer_scale(surface->child, 1);
+		wp_viewport_set_destination(surface->child_viewport,
+			indicator_size, indicator_size);
+	} else {
+		wl_surface_set_buffer_scale(surface->child, surface->scale);
+		if (surface->child_viewport) {
+			wp_viewport_set_destination(surface->child_viewport, -1, -1);
+		}
+	}
+	if (surface->indicator_buffer != &current->buffer) {
+		wl_surface_attach(surface->child, current->buffer.buffer, 0, 0);
+		if (surface->indicator_buffer) {
+			surface->indicator_buffer->users--;
+		}
+		surface->indicator_buffer = &current->buffer;
+		// The compositor releases buffers shared between surfaces once
+		// none of them shows it any more
+		current->buffer.users++;
+		current->buffer.busy = true;
+	}
+	if (damage.width > 0 && damage.height > 0) {
+		wl_surface_damage_buffer(surface->child,
+			damage.x, damage.y, damage.width, damage.height);
+	}
 	wl_surface_commit(surface->child);
 
 	wl_surface_commit(surface->surface);
+	trace_output_event(&surface->traced, TRACE_INDICATOR_COMMIT,
+		surface->output_name);
+}
+
+void render_frame(struct swaylock_surface *surface) {
+	struct swaylock_state *state = surface->state;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	update_indicator(surface);
+	stats_record_time(surface->stats, STATS_RENDER_INDICATOR, &start);
+
+	if (!surface->indicator_frame.animating ||
+			state->args.animation_budget <= 0) {
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	int64_t us = (int64_t)(end.tv_sec - start.tv_sec) * 1000000 +
+		(end.tv_nsec - start.tv_nsec) / 1000;
+	struct indicator_animation *animation = &state->animation;
+	if (us <= state->args.animation_budget) {
+		animation->over_budget = 0;
+	} else if (++animation->over_budget >= MAX_FRAMES_OVER_BUDGET) {
+		// The first frame of an animation may well be slow, it can need a
+		// new buffer. Frames that keep being slow aren't worth it.
+		swaylock_log(LOG_DEBUG, "Animated frames take %" PRId64 " us, "
+			"skipping to the end", us);
+		animation_finish(animation);
+		animation->over_budget = 0;
+	}
+}
+
+void release_indicator(struct swaylock_surface *surface) {
+	if (surface->indicator_buffer) {
+		surface->indicator_buffer->users--;
+		surface->indicator_buffer = NULL;
+	}
+	surface->indicator_frame = (struct indicator_frame){ 0 };
+
+	struct indicator_group *group = surface->indicator;
+	if (group == NULL) {
+		return;
+	}
+	surface->indicator = NULL;
+	if (--group->refs == 0) {
+		prune_indicator_groups(surface->state);
+	}
 }
@@ -0,0 +1,414 @@
+#define _POSIX_C_SOURCE 200809L
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "log.h"
+#include "resample.h"
+
+/*
+ * The image is filtered in two passes: each source row the destination
+ * needs is first reduced to the width of the destination, and those rows are
+ * then summed up, weighed by how much of each destination row they cover.
+ * Pixels are kept as four floats in between, in the order of their bytes,
+ * so the SIMD kernels can work on a whole pixel at once.
+ *
+ * The kernels are picked on first use, by what the CPU supports. The SIMD
+ * ones rely on pixels being stored little endian.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RESAMPLE_X86 1
+#include <immintrin.h>
+#else
+#define RESAMPLE_X86 0
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON) && \
+	defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define RESAMPLE_NEON 1
+#include <arm_neon.h>
+#else
+#define RESAMPLE_NEON 0
+#endif
+
+// Which source pixels make up each destination pixel, along one axis
+struct filter {
+	int first, count; // destination pixels covered by the source
+	int taps; // source pixels weighed for each destination pixel
+	int *start; // first of those source pixels, for each destination pixel
+	float *weights; // taps weights per destination pixel, summing up to
+	                // the fraction of it the source covers
+};
+
+struct resample_kernels {
+	const char *name;
+	// Reduces a source row to the destination pixels of the filter
+	void (*filter_row)(const uint32_t *src, const struct filter *filter,
+		uint32_t alpha, float *out);
+	// Adds n floats of row, times the weight, to acc
+	void (*accumulate)(float *acc, const float *row, float weight, size_t n);
+	// Draws n pixels over the destination
+	void (*blend_row)(const float *acc, uint32_t *dst, int n);
+};
+
+static bool init_filter(struct filter *filter, int src_size, int dst_size,
+		double scale, double offset) {
+	*filter = (struct filter){ 0 };
+	double begin = fmax(offset, 0);
+	double end = fmin(offset + src_size * scale, dst_size);
+	if (end <= begin) {
+		return true;
+	}
+	filter->first = floor(begin);
+	filter->count = (int)ceil(end) - filter->first;
+	filter->taps = (int)ceil(1 / scale) + 1;
+	if (filter->taps > src_size) {
+		filter->taps = src_size;
+	}
+
+	filter->start = calloc(filter->count, sizeof(*filter->start));
+	filter->weights = calloc((size_t)filter->count * filter->taps,
+		sizeof(*filter->weights));
+	if (!filter->start || !filter->weights) {
+		swaylock_log(LOG_ERROR, "Failed to allocate resampling filter");
+		free(filter->start);
+		free(filter->weights);
+		*filter = (struct filter){ 0 };
+		return false;
+	}
+
+	for (int i = 0; i < filter->count; ++i) {
+		int pixel = filter->first + i;
+		// What the destination pixel covers, in source pixels
+		double a = fmax((pixel - offset) / scale, 0);
+		double b = fmin((pixel + 1 - offset) / scale, src_size);
+		int first = floor(a);
+		// All taps have to be inside the row, unused ones weigh nothing
+		int start = first;
+		if (start + filter->taps > src_size) {
+			start = src_size - filter->taps;
+		}
+		filter->start[i] = start;
+
+		float *weights = &filter->weights[(size_t)i * filter->taps];
+		for (int s = first; s < b && s - start < filter->taps; ++s) {
+			double overlap = fmin(b, s + 1) - fmax(a, s);
+			if (overlap > 0) {
+				weights[s - start] = overlap * scale;
+			}
+		}
+	}
+	return true;
+}
+
+static void finish_filter(struct filter *filter) {
+	free(filter->start);
+	free(filter->weights);
+}
+
+static void filter_row_generic(const uint32_t *src,
+		const struct filter *filter, uint32_t alpha, float *out) {
+	for (int i = 0; i < filter->count; ++i) {
+		const uint32_t *p = src + filter->start[i];
+		const float *weights = &filter->weights[(size_t)i * filter->taps];
+		float sum[4] = { 0 };
+		for (int t = 0; t < filter->taps; ++t) {
+			uint32_t pixel = p[t] | alpha;
+			for (int c = 0; c < 4; ++c) {
+				sum[c] += ((pixel >> (c * 8)) & 0xff) * weights[t];
+			}
+		}
+		memcpy(&out[i * 4], sum, sizeof(sum));
+	}
+}
+
+static void accumulate_generic(float *acc, const float *row, float weight,
+		size_t n) {
+	for (size_t i = 0; i < n; ++i) {
+		acc[i] += row[i] * weight;
+	}
+}
+
+static void blend_row_generic(const float *acc, uint32_t *dst, int n) {
+	for (int i = 0; i < n; ++i) {
+		const float *src = &acc[i * 4];
+		float inverse_alpha = 1 - src[3] / 255;
+		uint32_t pixel = dst[i], out = 0;
+		for (int c = 0; c < 4; ++c) {
+			float value = src[c] +
+				((pixel >> (c * 8)) & 0xff) * inverse_alpha + 0.5f;
+			value = value < 0 ? 0 : value > 255 ? 255 : value;
+			out |= (uint32_t)value << (c * 8);
+		}
+		dst[i] = out;
+	}
+}
+
+static const struct resample_kernels generic_kernels = {
+	.name = "generic",
+	.filter_row = filter_row_generic,
+	.accumulate = accumulate_generic,
+	.blend_row = blend_row_generic,
+};
+
+#if RESAMPLE_X86
+__attribute__((target("sse2")))
+static inline __m128 load_pixel_sse2(uint32_t pixel) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i channels = _mm_cvtsi32_si128((int)pixel);
+	channels = _mm_unpacklo_epi8(channels, zero);
+	channels = _mm_unpacklo_epi16(channels, zero);
+	return _mm_cvtepi32_ps(channels);
+}
+
+__attribute__((target("sse2")))
+static inline uint32_t blend_pixel_sse2(__m128 src, uint32_t dst) {
+	__m128 alpha = _mm_shuffle_ps(src, src, _MM_SHUFFLE(3, 3, 3, 3));
+	__m128 inverse_alpha = _mm_sub_ps(_mm_set1_ps(1),
+		_mm_mul_ps(alpha, _mm_set1_ps(1 / 255.0f)));
+	__m128 value = _mm_add_ps(src,
+		_mm_mul_ps(load_pixel_sse2(dst), inverse_alpha));
+	__m128i channels = _mm_cvtps_epi32(value);
+	channels = _mm_packs_epi32(channels, channels);
+	channels = _mm_packus_epi16(channels, channels);
+	return (uint32_t)_mm_cvtsi128_si32(channels);
+}
+
+__attribute__((target("sse2")))
+static void filter_row_sse2(const uint32_t *src, const struct filter *filter,
+		uint32_t alpha, float *out) {
+	for (int i = 0; i < filter->count; ++i) {
+		const uint32_t *p = src + filter->start[i];
+		const float *weights = &filter->weights[(size_t)i * filter->taps];
+		__m128 sum = _mm_setzero_ps();
+		for (int t = 0; t < filter->taps; ++t) {
+			sum = _mm_add_ps(sum, _mm_mul_ps(load_pixel_sse2(p[t] | alpha),
+				_mm_set1_ps(weights[t])));
+		}
+		_mm_storeu_ps(&out[i * 4], sum);
+	}
+}
+
+__attribute__((target("sse2")))
+static void accumulate_sse2(float *acc, const float *row, float weight,
+		size_t n) {
+	__m128 w = _mm_set1_ps(weight);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		_mm_storeu_ps(&acc[i], _mm_add_ps(_mm_loadu_ps(&acc[i]),
+			_mm_mul_ps(_mm_loadu_ps(&row[i]), w)));
+	}
+	accumulate_generic(&acc[i], &row[i], weight, n - i);
+}
+
+__attribute__((target("sse2")))
+static void blend_row_sse2(const float *acc, uint32_t *dst, int n) {
+	for (int i = 0; i < n; ++i) {
+		dst[i] = blend_pixel_sse2(_mm_loadu_ps(&acc[i * 4]), dst[i]);
+	}
+}
+
+static const struct resample_kernels sse2_kernels = {
+	.name = "SSE2",
+	.filter_row = filter_row_sse2,
+	.accumulate = accumulate_sse2,
+	.blend_row = blend_row_sse2,
+};
+
+// Two pixels at a time, one in each 128-bit lane
+__attribute__((target("avx2,fma")))
+static inline __m256 load_pixels_avx2(const uint32_t *pixels, uint32_t alpha) {
+	__m128i pair = _mm_loadl_epi64((const __m128i *)pixels);
+	pair = _mm_or_si128(pair, _mm_set1_epi32((int)alpha));
+	return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(pair));
+}
+
+__attribute__((target("avx2,fma")))
+static void filter_row_avx2(const uint32_t *src, const struct filter *filter,
+		uint32_t alpha, float *out) {
+	for (int i = 0; i < filter->count; ++i) {
+		const uint32_t *p = src + filter->start[i];
+		const float *weights = &filter->weights[(size_t)i * filter->taps];
+		__m256 sum = _mm256_setzero_ps();
+		int t = 0;
+		for (; t + 2 <= filter->taps; t += 2) {
+			__m256 w = _mm256_insertf128_ps(
+				_mm256_castps128_ps256(_mm_set1_ps(weights[t])),
+				_mm_set1_ps(weights[t + 1]), 1);
+			sum = _mm256_fmadd_ps(load_pixels_avx2(&p[t], alpha), w, sum);
+		}
+		__m128 total = _mm_add_ps(_mm256_castps256_ps128(sum),
+			_mm256_extractf128_ps(sum, 1));
+		if (t < filter->taps) {
+			__m128i pixel = _mm_cvtsi32_si128((int)(p[t] | alpha));
+			total = _mm_fmadd_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(pixel)),
+				_mm_set1_ps(weights[t]), total);
+		}
+		_mm_storeu_ps(&out[i * 4], total);
+	}
+}
+
+__attribute__((target("avx2,fma")))
+static void accumulate_avx2(float *acc, const float *row, float weight,
+		size_t n) {
+	__m256 w = _mm256_set1_ps(weight);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		_mm256_storeu_ps(&acc[i], _mm256_fmadd_ps(_mm256_loadu_ps(&row[i]), w,
+			_mm256_loadu_ps(&acc[i])));
+	}
+	accumulate_generic(&acc[i], &row[i], weight, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+static void blend_row_avx2(const float *acc, uint32_t *dst, int n) {
+	int i = 0;
+	for (; i + 2 <= n; i += 2) {
+		__m256 src = _mm256_loadu_ps(&acc[i * 4]);
+		__m256 alpha = _mm256_permute_ps(src, _MM_SHUFFLE(3, 3, 3, 3));
+		__m256 inverse_alpha = _mm256_fnmadd_ps(alpha,
+			_mm256_set1_ps(1 / 255.0f), _mm256_set1_ps(1));
+		__m256 value = _mm256_fmadd_ps(load_pixels_avx2(&dst[i], 0),
+			inverse_alpha, src);
+		__m256i channels = _mm256_cvtps_epi32(value);
+		channels = _mm256_packs_epi32(channels, channels);
+		channels = _mm256_packus_epi16(channels, channels);
+		dst[i] = (uint32_t)_mm_cvtsi128_si32(_mm256_castsi256_si128(channels));
+		dst[i + 1] = (uint32_t)_mm_cvtsi128_si32(
+			_mm256_extracti128_si256(channels, 1));
+	}
+	if (i < n) {
+		dst[i] = blend_pixel_sse2(_mm_loadu_ps(&acc[i * 4]), dst[i]);
+	}
+}
+
+static const struct resample_kernels avx2_kernels = {
+	.name = "AVX2",
+	.filter_row = filter_row_avx2,
+	.accumulate = accumulate_avx2,
+	.blend_row = blend_row_avx2,
+};
+#endif
+
+#if RESAMPLE_NEON
+static inline float32x4_t load_pixel_neon(uint32_t pixel) {
+	uint8x8_t bytes = vreinterpret_u8_u32(vdup_n_u32(pixel));
+	return vcvtq_f32_u32(vmovl_u16(vget_low_u16(vmovl_u8(bytes))));
+}
+
+static void filter_row_neon(const uint32_t *src, const struct filter *filter,
+		uint32_t alpha, float *out) {
+	for (int i = 0; i < filter->count; ++i) {
+		const uint32_t *p = src + filter->start[i];
+		const float *weights = &filter->weights[(size_t)i * filter->taps];
+		float32x4_t sum = vdupq_n_f32(0);
+		for (int t = 0; t < filter->taps; ++t) {
+			sum = vfmaq_n_f32(sum, load_pixel_neon(p[t] | alpha), weights[t]);
+		}
+		vst1q_f32(&out[i * 4], sum);
+	}
+}
+
+static void accumulate_neon(float *acc, const float *row, float weight,
+		size_t n) {
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		vst1q_f32(&acc[i], vfmaq_n_f32(vld1q_f32(&acc[i]),
+			vld1q_f32(&row[i]), weight));
+	}
+	accumulate_generic(&acc[i], &row[i], weight, n - i);
+}
+
+static void blend_row_neon(const float *acc, uint32_t *dst, int n) {
+	for (int i = 0; i < n; ++i) {
+		float32x4_t src = vld1q_f32(&acc[i * 4]);
+		float32x4_t inverse_alpha = vmlsq_n_f32(vdupq_n_f32(1),
+			vdupq_laneq_f32(src, 3), 1 / 255.0f);
+		float32x4_t value = vfmaq_f32(src, load_pixel_neon(dst[i]),
+			inverse_alpha);
+		uint16x4_t channels = vqmovn_u32(vcvtnq_u32_f32(value));
+		uint8x8_t bytes = vqmovn_u16(vcombine_u16(channels, channels));
+		dst[i] = vget_lane_u32(vreinterpret_u32_u8(bytes), 0);
+	}
+}
+
+static const struct resample_kernels neon_kernels = {
+	.name = "NEON",
+	.filter_row = filter_row_neon,
+	.accumulate = accumulate_neon,
+	.blend_row = blend_row_neon,
+};
+#endif
+
+static const struct resample_kernels *kernels = &generic_kernels;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void pick_kernels(void) {
+#if RESAMPLE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		kernels = &avx2_kernels;
+	} else if (__builtin_cpu_supports("sse2")) {
+		kernels = &sse2_kernels;
+	}
+#elif RESAMPLE_NEON
+	kernels = &neon_kernels;
+#endif
+	swaylock_log(LOG_DEBUG, "Resampling images with %s kernels",
+		kernels->name);
+}
+
+bool resample_over(const uint32_t *src, int src_stride, int src_width,
+		int src_height, bool opaque, uint32_t *dst, int dst_stride,
+		int dst_width, int dst_height, double scale_x, double scale_y,
+		double x, double y) {
+	pthread_once(&kernels_once, pick_kernels);
+
+	bool ok = false;
+	float *row = NULL, *acc = NULL;
+	// Both are freed on the way out, even if the first one failed
+	struct filter columns = { 0 }, rows = { 0 };
+	if (!init_filter(&columns, src_width, dst_width, scale_x, x) ||
+			!init_filter(&rows, src_height, dst_height, scale_y, y)) {
+		goto out;
+	}
+	if (columns.count == 0 || rows.count == 0) {
+		ok = true;
+		goto out;
+	}
+
+	size_t floats = (size_t)columns.count * 4;
+	row = malloc(floats * sizeof(float));
+	acc = malloc(floats * sizeof(float));
+	if (!row || !acc) {
+		swaylock_log(LOG_ERROR, "Failed to allocate resampling buffers");
+		goto out;
+	}
+
+	uint32_t alpha = opaque ? 0xff000000 : 0;
+	for (int i = 0; i < rows.count; ++i) {
+		memset(acc, 0, floats * sizeof(float));
+		const float *weights = &rows.weights[(size_t)i * rows.taps];
+		for (int t = 0; t < rows.taps; ++t) {
+			if (weights[t] == 0) {
+				continue;
+			}
+			const uint32_t *src_row = (const uint32_t *)((const char *)src +
+				(size_t)(rows.start[i] + t) * src_stride);
+			kernels->filter_row(src_row, &columns, alpha, row);
+			kernels->accumulate(acc, row, weights[t], floats);
+		}
+		uint32_t *dst_row = (uint32_t *)((char *)dst +
+			(size_t)(rows.first + i) * dst_stride);
+		kernels->blend_row(acc, dst_row + columns.first, columns.count);
+	}
+	ok = true;
+
+out:
+	free(row);
+	free(acc);
+	finish_filter(&columns);
+	finish_filter(&rows);
+	return ok;
+}
@@ -0,0 +1,288 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include <wayland-client.h>
+#include "cairo.h"
+#include "log.h"
+#include "pool-buffer.h"
+#include "screenshot.h"
+#include "swaylock.h"
+#include "ext-image-capture-source-v1-client-protocol.h"
+#include "ext-image-copy-capture-v1-client-protocol.h"
+
+struct screenshot {
+	struct swaylock_state *state;
+	struct swaylock_image *image;
+	struct ext_image_capture_source_v1 *source;
+	struct ext_image_copy_capture_session_v1 *session;
+	struct ext_image_copy_capture_frame_v1 *frame;
+	uint32_t width, height; // of the buffer
+	bool xrgb, argb; // shm formats the compositor can copy into
+	enum wl_output_transform transform;
+	struct pool_buffer *buffer;
+	struct wl_list link; // screenshots
+};
+
+static struct wl_list screenshots = { &screenshots, &screenshots };
+
+bool screenshots_pending(void) {
+	return !wl_list_empty(&screenshots);
+}
+
+static void destroy_captured_buffer(void *data) {
+	struct pool_buffer *buffer = data;
+	destroy_buffer(buffer);
+	free(buffer);
+}
+
+static const cairo_user_data_key_t buffer_key;
+
+// Maps the buffer onto the output the way the compositor does, so rotated
+// and flipped outputs show their screenshot upright
+static cairo_surface_t *transform_image(cairo_surface_t *image,
+		enum wl_output_transform transform) {
+	int width = cairo_image_surface_get_width(image);
+	int height = cairo_image_surface_get_height(image);
+	bool rotated = transform & WL_OUTPUT_TRANSFORM_90;
+	int output_width = rotated ? height : width;
+	int output_height = rotated ? width : height;
+
+	cairo_surface_t *result = cairo_image_surface_create(
+		cairo_image_surface_get_format(image), output_width, output_height);
+	if (cairo_surface_status(result) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(result);
+		return NULL;
+	}
+
+	// Undoes the rotation of the output, in exact quarter turns so no
+	// pixels get resampled
+	static const double cosines[] = { 1, 0, -1, 0 };
+	static const double sines[] = { 0, -1, 0, 1 };
+	int turns = transform & 3;
+	cairo_matrix_t matrix;
+	cairo_matrix_init(&matrix, cosines[turns], sines[turns],
+		-sines[turns], cosines[turns], 0, 0);
+
+	cairo_t *cairo = cairo_create(result);
+	cairo_translate(cairo, output_width / 2.0, output_height / 2.0);
+	cairo_transform(cairo, &matrix);
+	if (transform & WL_OUTPUT_TRANSFORM_FLIPPED) {
+		cairo_scale(cairo, -1, 1);
+	}
+	cairo_translate(cairo, -width / 2.0, -height / 2.0);
+	cairo_set_source_surface(cairo, image, 0, 0);
+	cairo_pattern_set_filter(cairo_get_source(cairo), CAIRO_FILTER_NEAREST);
+	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+	cairo_paint(cairo);
+	cairo_destroy(cairo);
+	return result;
+}
+
+static cairo_surface_t *create_image(struct screenshot *screenshot) {
+	struct pool_buffer *buffer = screenshot->buffer;
+	// The alpha of XRGB8888 pixels is undefined
+	cairo_format_t format = screenshot->xrgb ?
+		CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_ARGB32;
+	cairo_surface_t *image = cairo_image_surface_create_for_data(buffer->data,
+		format, buffer->width, buffer->height, buffer->stride);
+	if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(image);
+		return NULL;
+	}
+
+	if (screenshot->transform != WL_OUTPUT_TRANSFORM_NORMAL) {
+		cairo_surface_t *result = transform_image(image,
+			screenshot->transform);
+		cairo_surface_destroy(image);
+		return result;
+	}
+
+	// Shown straight from the buffer, which the image keeps alive. Only
+	// the mapping is still needed.
+	wl_buffer_destroy(buffer->buffer);
+	buffer->buffer = NULL;
+	if (cairo_surface_set_user_data(image, &buffer_key, buffer,
+				destroy_captured_buffer) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(image);
+		return NULL;
+	}
+	screenshot->buffer = NULL;
+	return image;
+}
+
+static void finish_screenshot(struct screenshot *screenshot,
+		cairo_surface_t *result) {
+	if (screenshot->frame) {
+		ext_image_copy_capture_frame_v1_destroy(screenshot->frame);
+	}
+	ext_image_copy_capture_session_v1_destroy(screenshot->session);
+	ext_image_capture_source_v1_destroy(screenshot->source);
+	if (screenshot->buffer) {
+		destroy_captured_buffer(screenshot->buffer);
+	}
+	if (!result) {
+		swaylock_log(LOG_ERROR, "Failed to capture output %s",
+			screenshot->image->output_name);
+	}
+	wl_list_remove(&screenshot->link);
+	finish_image_load(screenshot->state, screenshot->image, result);
+	free(screenshot);
+}
+
+void screenshots_cancel(void) {
+	struct screenshot *screenshot, *tmp;
+	wl_list_for_each_safe(screenshot, tmp, &screenshots, link) {
+		finish_screenshot(screenshot, NULL);
+	}
+}
+
+static void frame_handle_transform(void *data,
+		struct ext_image_copy_capture_frame_v1 *frame, uint32_t transform) {
+	struct screenshot *screenshot = data;
+	screenshot->transform = transform;
+}
+
+static void frame_handle_damage(void *data,
+		struct ext_image_copy_capture_frame_v1 *frame,
+		int32_t x, int32_t y, int32_t width, int32_t height) {
+	// Only ever one frame is captured, all of it is new
+}
+
+static void frame_handle_presentation_time(void *data,
+		struct ext_image_copy_capture_frame_v1 *frame,
+		uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+	// Who cares
+}
+
+static void frame_handle_ready(void *data,
+		struct ext_image_copy_capture_frame_v1 *frame) {
+	struct screenshot *screenshot = data;
+	finish_screenshot(screenshot, create_image(screenshot));
+}
+
+static void frame_handle_failed(void *data,
+		struct ext_image_copy_capture_frame_v1 *frame, uint32_t reason) {
+	struct screenshot *screenshot = data;
+	finish_screenshot(screenshot, NULL);
+}
+
+static const struct ext_image_copy_capture_frame_v1_listener frame_listener = {
+	.transform = frame_handle_transform,
+	.damage = frame_handle_damage,
+	.presentation_time = frame_handle_presentation_time,
+	.ready = frame_handle_ready,
+	.failed = frame_handle_failed,
+};
+
+static void session_handle_buffer_size(void *data,
+		struct ext_image_copy_capture_session_v1 *session,
+		uint32_t width, uint32_t height) {
+	struct screenshot *screenshot = data;
+	screenshot->width = width;
+	screenshot->height = height;
+}
+
+static void session_handle_shm_format(void *data,
+		struct ext_image_copy_capture_session_v1 *session, uint32_t format) {
+	struct screenshot *screenshot = data;
+	if (format == WL_SHM_FORMAT_XRGB8888) {
+		screenshot->xrgb = true;
+	} else if (format == WL_SHM_FORMAT_ARGB8888) {
+		screenshot->argb = true;
+	}
+}
+
+static void session_handle_dmabuf_device(void *data,
+		struct ext_image_copy_capture_session_v1 *session,
+		struct wl_array *device) {
+	// The pixels are read back on the CPU, shared memory is what they
+	// should end up in
+}
+
+static void session_handle_dmabuf_format(void *data,
+		struct ext_image_copy_capture_session_v1 *session, uint32_t format,
+		struct wl_array *modifiers) {
+	// Likewise
+}
+
+static void session_handle_done(void *data,
+		struct ext_image_copy_capture_session_v1 *session) {
+	struct screenshot *screenshot = data;
+	if (screenshot->frame) {
+		// The constraints changed while capturing, the compositor fails
+		// the frame if the buffer no longer fits them
+		return;
+	}
+	if (screenshot->width == 0 || screenshot->height == 0 ||
+			(!screenshot->xrgb && !screenshot->argb)) {
+		finish_screenshot(screenshot, NULL);
+		return;
+	}
+
+	screenshot->buffer = calloc(1, sizeof(struct pool_buffer));
+	if (!screenshot->buffer || !create_shm_buffer(screenshot->state->shm,
+				screenshot->buffer, screenshot->width, screenshot->height,
+				screenshot->xrgb ? WL_SHM_FORMAT_XRGB8888 :
+				WL_SHM_FORMAT_ARGB8888)) {
+		swaylock_log(LOG_ERROR, "Failed to create screenshot buffer");
+		free(screenshot->buffer);
+		screenshot->buffer = NULL;
+		finish_screenshot(screenshot, NULL);
+		return;
+	}
+
+	screenshot->frame = ext_image_copy_capture_session_v1_create_frame(session);
+	ext_image_copy_capture_frame_v1_add_listener(screenshot->frame,
+		&frame_listener, screenshot);
+	ext_image_copy_capture_frame_v1_attach_buffer(screenshot->frame,
+		screenshot->buffer->buffer);
+	ext_image_copy_capture_frame_v1_damage_buffer(screenshot->frame,
+		0, 0, screenshot->width, screenshot->height);
+	ext_image_copy_capture_frame_v1_capture(screenshot->frame);
+}
+
+static void session_handle_stopped(void *data,
+		struct ext_image_copy_capture_session_v1 *session) {
+	struct screenshot *screenshot = data;
+	finish_screenshot(screenshot, NULL);
+}
+
+static const struct ext_image_copy_capture_session_v1_listener session_listener = {
+	.buffer_size = session_handle_buffer_size,
+	.shm_format = session_handle_shm_format,
+	.dmabuf_device = session_handle_dmabuf_device,
+	.dmabuf_format = session_handle_dmabuf_format,
+	.done = session_handle_done,
+	.stopped = session_handle_stopped,
+};
+
+void screenshot_output(struct swaylock_surface *surface) {
+	struct swaylock_state *state = surface->state;
+	struct screenshot *screenshot = calloc(1, sizeof(struct screenshot));
+	struct swaylock_image *image = calloc(1, sizeof(struct swaylock_image));
+	char *output_name = strdup(surface->output_name);
+	if (!screenshot || !image || !output_name) {
+		swaylock_log(LOG_ERROR, "Unable to allocate memory for screenshot");
+		free(screenshot);
+		free(image);
+		free(output_name);
+		return;
+	}
+
+	// Ahead of the images given for the output, and nothing decodes it in
+	// the meantime
+	image->output_name = output_name;
+	image->load_state = IMAGE_LOADING;
+	wl_list_insert(&state->images, &image->link);
+
+	screenshot->state = state;
+	screenshot->image = image;
+	screenshot->source =
+		ext_output_image_capture_source_manager_v1_create_source(
+			state->output_capture_source_manager, surface->output);
+	screenshot->session = ext_image_copy_capture_manager_v1_create_session(
+		state->image_copy_capture_manager, screenshot->source, 0);
+	ext_image_copy_capture_session_v1_add_listener(screenshot->session,
+		&session_listener, screenshot);
+	wl_list_insert(&screenshots, &screenshot->link);
+}
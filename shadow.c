@@ -1,11 +1,14 @@
-#define _XOPEN_SOURCE // for crypt
+#define _GNU_SOURCE // for crypt and crypt_r
 #include <pwd.h>
 #include <shadow.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
-#ifdef __GLIBC__
+#include "config.h"
+#if defined(__GLIBC__) || HAVE_CRYPT_R
 // GNU, you damn slimy bastard
 #include <crypt.h>
 #endif
@@ -40,6 +43,27 @@ void initialize_pw_backend(int argc, char **argv) {
 	}
 }
 
+#if HAVE_CRYPT_R
+// Reused by every check. It is large, and libcrypt keeps the state of the
+// hashing method in it between calls.
+static struct crypt_data crypt_data;
+#endif
+
+static const char *check_password(const char *password, const char *encpw) {
+#if HAVE_CRYPT_R
+	return crypt_r(password, encpw, &crypt_data);
+#else
+	return crypt(password, encpw);
+#endif
+}
+
+static long elapsed_ms(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
 void run_pw_backend_child(void) {
 	/* This code runs as root */
 	struct passwd *pwent = getpwuid(getuid());
@@ -71,6 +95,16 @@ void run_pw_backend_child(void) {
 
 	/* This code does not run as root */
 	swaylock_log(LOG_DEBUG, "Prepared to authorize user %s", pwent->pw_name);
+	// The prefix names the hashing method, e.g. $y$ for yescrypt
+	const char *method_end = encpw[0] == '$' ? strchr(encpw + 1, '$') : NULL;
+	int method_len = method_end ? (int)(method_end - encpw) + 1 : 0;
+	swaylock_log(LOG_DEBUG, "Password hash method: %.*s", method_len,
+		method_len ? encpw : "DES");
+
+	// Nothing to warm up, the hash was read while running as root
+	if (!write_comm_ready()) {
+		exit(EXIT_FAILURE);
+	}
 
 	while (1) {
 		char *buf;
@@ -81,7 +115,9 @@ void run_pw_backend_child(void) {
 			break;
 		}
 
-		const char *c = crypt(buf, encpw);
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		const char *c = check_password(buf, encpw);
 		password_buffer_destroy(buf, size);
 		buf = NULL;
 
@@ -90,6 +126,8 @@ void run_pw_backend_child(void) {
 			exit(EXIT_FAILURE);
 		}
 		bool success = strcmp(c, encpw) == 0;
+		swaylock_log(LOG_DEBUG, "Password hash verified in %ld ms",
+			elapsed_ms(&start));
 
 		if (!write_comm_reply(success)) {
 			exit(EXIT_FAILURE);
@@ -99,5 +137,8 @@ void run_pw_backend_child(void) {
 	}
 
 	clear_buffer(encpw, strlen(encpw));
+#if HAVE_CRYPT_R
+	clear_buffer((char *)&crypt_data, sizeof(crypt_data));
+#endif
 	exit(EXIT_SUCCESS);
 }
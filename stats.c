@@ -0,0 +1,194 @@
+#define _POSIX_C_SOURCE 200809L
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wayland-client.h>
+#include "log.h"
+#include "stats.h"
+
+/*
+ * Histograms have power of two buckets: bucket i counts times from 2^i up to
+ * 2^(i+1) microseconds, the last one everything longer.
+ */
+#define STATS_BUCKETS 24
+
+struct histogram {
+	uint64_t count;
+	uint64_t total_us, max_us;
+	uint64_t buckets[STATS_BUCKETS];
+};
+
+struct output_stats {
+	char *name;
+	struct histogram histograms[STATS_HISTOGRAM_COUNT];
+	uint64_t paths[STATS_RENDER_PATH_COUNT];
+	uint64_t allocations, allocated_bytes;
+	uint64_t dropped_frames;
+	struct wl_list link;
+};
+
+static const char *const histogram_names[] = {
+	[STATS_RENDER_BACKGROUND] = "render_background_us",
+	[STATS_RENDER_INDICATOR] = "render_indicator_us",
+	[STATS_KEY_TO_PRESENT] = "key_to_present_us",
+};
+
+static const char *const path_names[] = {
+	[STATS_BACKGROUND_REUSED] = "background_reused",
+	[STATS_BACKGROUND_SHARED] = "background_shared",
+	[STATS_BACKGROUND_DISK_CACHE] = "background_disk_cache",
+	[STATS_BACKGROUND_SOLID] = "background_solid",
+	[STATS_BACKGROUND_RENDERED] = "background_rendered",
+	[STATS_INDICATOR_REUSED] = "indicator_reused",
+	[STATS_INDICATOR_RENDERED] = "indicator_rendered",
+};
+
+static struct wl_list outputs = { &outputs, &outputs };
+
+struct output_stats *stats_get_output(const char *name) {
+	if (!name) {
+		name = "";
+	}
+	struct output_stats *stats;
+	wl_list_for_each(stats, &outputs, link) {
+		if (strcmp(stats->name, name) == 0) {
+			return stats;
+		}
+	}
+
+	stats = calloc(1, sizeof(*stats));
+	if (!stats) {
+		swaylock_log(LOG_ERROR, "Unable to allocate memory for stats");
+		return NULL;
+	}
+	stats->name = strdup(name);
+	if (!stats->name) {
+		swaylock_log(LOG_ERROR, "Unable to allocate memory for stats");
+		free(stats);
+		return NULL;
+	}
+	wl_list_insert(outputs.prev, &stats->link);
+	return stats;
+}
+
+void stats_record_time(struct output_stats *stats,
+		enum stats_histogram histogram, const struct timespec *start) {
+	if (!stats) {
+		return;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t us = (int64_t)(now.tv_sec - start->tv_sec) * 1000000 +
+		(now.tv_nsec - start->tv_nsec) / 1000;
+	if (us < 0) {
+		us = 0;
+	}
+
+	struct histogram *h = &stats->histograms[histogram];
+	h->count++;
+	h->total_us += us;
+	if ((uint64_t)us > h->max_us) {
+		h->max_us = us;
+	}
+	size_t bucket = 0;
+	while (bucket + 1 < STATS_BUCKETS && (uint64_t)us >> (bucket + 1)) {
+		++bucket;
+	}
+	h->buckets[bucket]++;
+}
+
+void stats_count_path(struct output_stats *stats, enum stats_render_path path) {
+	if (stats) {
+		stats->paths[path]++;
+	}
+}
+
+void stats_count_allocation(struct output_stats *stats, size_t bytes) {
+	if (stats) {
+		stats->allocations++;
+		stats->allocated_bytes += bytes;
+	}
+}
+
+void stats_count_dropped_frame(struct output_stats *stats) {
+	if (stats) {
+		stats->dropped_frames++;
+	}
+}
+
+static void write_output(FILE *f, struct output_stats *stats) {
+	fprintf(f, "{\"pid\":%d,\"output\":\"", (int)getpid());
+	for (const unsigned char *p = (const unsigned char *)stats->name;
+			*p; ++p) {
+		if (*p == '"' || *p == '\\') {
+			fprintf(f, "\\%c", *p);
+		} else if (*p < 0x20) {
+			fprintf(f, "\\u%04x", *p);
+		} else {
+			fputc(*p, f);
+		}
+	}
+	fputc('"', f);
+
+	for (size_t i = 0; i < STATS_HISTOGRAM_COUNT; ++i) {
+		struct histogram *h = &stats->histograms[i];
+		fprintf(f, ",\"%s\":{\"count\":%" PRIu64 ",\"total\":%" PRIu64
+			",\"max\":%" PRIu64 ",\"log2_buckets\":[", histogram_names[i],
+			h->count, h->total_us, h->max_us);
+		// Trailing empty buckets are left out
+		size_t used = STATS_BUCKETS;
+		while (used > 0 && h->buckets[used - 1] == 0) {
+			--used;
+		}
+		for (size_t j = 0; j < used; ++j) {
+			fprintf(f, j ? ",%" PRIu64 : "%" PRIu64, h->buckets[j]);
+		}
+		fputs("]}", f);
+	}
+
+	fputs(",\"paths\":{", f);
+	for (size_t i = 0; i < STATS_RENDER_PATH_COUNT; ++i) {
+		fprintf(f, "%s\"%s\":%" PRIu64, i ? "," : "", path_names[i],
+			stats->paths[i]);
+	}
+	fprintf(f, "},\"allocations\":%" PRIu64 ",\"allocated_bytes\":%" PRIu64
+		",\"dropped_frames\":%" PRIu64 "}\n", stats->allocations,
+		stats->allocated_bytes, stats->dropped_frames);
+}
+
+bool stats_write(const char *path) {
+	FILE *f = stderr;
+	if (strcmp(path, "-") != 0) {
+		f = fopen(path, "a");
+		if (!f) {
+			swaylock_log_errno(LOG_ERROR, "Unable to open stats file %s", path);
+			return false;
+		}
+	}
+
+	struct output_stats *stats;
+	wl_list_for_each(stats, &outputs, link) {
+		write_output(f, stats);
+	}
+
+	bool ok = fflush(f) == 0;
+	if (f != stderr && fclose(f) != 0) {
+		ok = false;
+	}
+	if (!ok) {
+		swaylock_log_errno(LOG_ERROR, "Failed to write stats to %s", path);
+	}
+	return ok;
+}
+
+void stats_destroy(void) {
+	struct output_stats *stats, *tmp;
+	wl_list_for_each_safe(stats, tmp, &outputs, link) {
+		wl_list_remove(&stats->link);
+		free(stats->name);
+		free(stats);
+	}
+}
@@ -0,0 +1,177 @@
+#define _POSIX_C_SOURCE 200809L
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "trace.h"
+
+/*
+ * Each event is written as one JSON object per line:
+ *
+ *   {"pid":123,"ts_us":4567,"event":"configure","output":"DP-1"}
+ *
+ * ts_us is CLOCK_MONOTONIC in microseconds, so lines from swaylock can be
+ * lined up with other logs taken with the same clock (e.g. the time the
+ * lid was closed). Files are appended to, the pid tells runs apart.
+ */
+
+#define MAX_EARLY_EVENTS 16
+
+struct early_event {
+	const char *event;
+	struct timespec time;
+};
+
+static FILE *trace_file = NULL;
+static bool trace_disabled = false;
+// Events recorded before the options were parsed
+static struct early_event early_events[MAX_EARLY_EVENTS];
+static size_t early_event_count = 0;
+
+static const char *const output_event_names[] = {
+	"configure",
+	"background_commit",
+	"indicator_commit",
+};
+
+static int64_t timespec_to_us(const struct timespec *ts) {
+	return (int64_t)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+static void write_json_string(const char *str) {
+	fputc('"', trace_file);
+	for (const unsigned char *p = (const unsigned char *)str; *p; ++p) {
+		if (*p == '"' || *p == '\\') {
+			fprintf(trace_file, "\\%c", *p);
+		} else if (*p < 0x20) {
+			fprintf(trace_file, "\\u%04x", *p);
+		} else {
+			fputc(*p, trace_file);
+		}
+	}
+	fputc('"', trace_file);
+}
+
+static void write_event(int64_t ts_us, const char *event, const char *output) {
+	fprintf(trace_file, "{\"pid\":%d,\"ts_us\":%" PRId64 ",\"event\":",
+		(int)getpid(), ts_us);
+	write_json_string(event);
+	if (output) {
+		fputs(",\"output\":", trace_file);
+		write_json_string(output);
+	}
+	fputs("}\n", trace_file);
+	// Keep what was traced if we get killed
+	fflush(trace_file);
+}
+
+#ifdef CLOCK_BOOTTIME
+// When the process was started, from /proc. The kernel only keeps it in
+// clock ticks since boot, so this is accurate to a tick.
+static bool get_exec_time(int64_t *ts_us) {
+	FILE *f = fopen("/proc/self/stat", "r");
+	if (!f) {
+		return false;
+	}
+	char line[1024];
+	bool ok = fgets(line, sizeof(line), f) != NULL;
+	fclose(f);
+	// The command name may contain spaces, fields are counted after it
+	char *p = ok ? strrchr(line, ')') : NULL;
+	if (!p) {
+		return false;
+	}
+	// starttime is the 22nd field, the 20th after the command name
+	for (int field = 0; field < 20 && p; ++field) {
+		p = strchr(p + 1, ' ');
+	}
+	long ticks_per_second = sysconf(_SC_CLK_TCK);
+	if (!p || ticks_per_second <= 0) {
+		return false;
+	}
+	unsigned long long start_ticks = strtoull(p + 1, NULL, 10);
+
+	struct timespec boot, now;
+	clock_gettime(CLOCK_BOOTTIME, &boot);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t since_exec = timespec_to_us(&boot) -
+		(int64_t)(start_ticks * 1000000 / ticks_per_second);
+	*ts_us = timespec_to_us(&now) - since_exec;
+	return true;
+}
+#endif
+
+bool trace_open(const char *path) {
+	if (!path) {
+		trace_disabled = true;
+		early_event_count = 0;
+		return true;
+	}
+	if (strcmp(path, "-") == 0) {
+		trace_file = stderr;
+	} else {
+		trace_file = fopen(path, "a");
+		if (!trace_file) {
+			swaylock_log_errno(LOG_ERROR, "Unable to open trace file %s", path);
+			trace_disabled = true;
+			return false;
+		}
+	}
+
+#ifdef CLOCK_BOOTTIME
+	int64_t exec_us;
+	if (get_exec_time(&exec_us)) {
+		write_event(exec_us, "exec", NULL);
+	}
+#endif
+	for (size_t i = 0; i < early_event_count; ++i) {
+		write_event(timespec_to_us(&early_events[i].time),
+			early_events[i].event, NULL);
+	}
+	early_event_count = 0;
+	return true;
+}
+
+void trace_close(void) {
+	if (trace_file && trace_file != stderr) {
+		fclose(trace_file);
+	}
+	trace_file = NULL;
+	trace_disabled = true;
+}
+
+void trace_event(const char *event) {
+	if (trace_disabled) {
+		return;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (trace_file) {
+		write_event(timespec_to_us(&now), event, NULL);
+	} else if (early_event_count < MAX_EARLY_EVENTS) {
+		early_events[early_event_count++] = (struct early_event){
+			.event = event,
+			.time = now,
+		};
+	}
+}
+
+void trace_output_event(uint32_t *seen, enum trace_output_event event,
+		const char *output) {
+	if (!trace_file || (*seen & event)) {
+		return;
+	}
+	*seen |= event;
+
+	size_t index = 0;
+	while ((1u << index) != (uint32_t)event) {
+		++index;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	write_event(timespec_to_us(&now), output_event_names[index],
+		output ? output : "");
+}
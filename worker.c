@@ -0,0 +1,162 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <wayland-client.h>
+#include "log.h"
+#include "loop.h"
+#include "worker.h"
+
+#define MAX_DEFAULT_THREADS 4
+
+struct worker_job {
+	void (*work)(void *data);
+	void (*done)(void *data);
+	void *data;
+	struct wl_list link; // struct worker_pool::pending or ::finished
+};
+
+struct worker_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct wl_list pending; // struct worker_job::link, oldest last
+	struct wl_list finished; // struct worker_job::link, oldest first
+	// Written to by the workers whenever `finished` stops being empty
+	int notify_fds[2];
+};
+
+static void *worker_thread(void *data) {
+	struct worker_pool *pool = data;
+
+	pthread_mutex_lock(&pool->lock);
+	while (true) {
+		while (wl_list_empty(&pool->pending)) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		}
+		struct worker_job *job =
+			wl_container_of(pool->pending.prev, job, link);
+		wl_list_remove(&job->link);
+		pthread_mutex_unlock(&pool->lock);
+
+		job->work(job->data);
+
+		pthread_mutex_lock(&pool->lock);
+		bool notify = wl_list_empty(&pool->finished);
+		wl_list_insert(pool->finished.prev, &job->link);
+		if (notify) {
+			(void)write(pool->notify_fds[1], "1", 1);
+		}
+	}
+	return NULL;
+}
+
+static void handle_finished(int fd, short mask, void *data) {
+	struct worker_pool *pool = data;
+
+	char buf[16];
+	while (read(fd, buf, sizeof(buf)) > 0) {
+		// Drain the pipe
+	}
+
+	struct wl_list finished;
+	wl_list_init(&finished);
+	pthread_mutex_lock(&pool->lock);
+	// Take the whole list, so callbacks run without the lock held
+	wl_list_insert_list(&finished, &pool->finished);
+	wl_list_init(&pool->finished);
+	pthread_mutex_unlock(&pool->lock);
+
+	struct worker_job *job, *tmp;
+	wl_list_for_each_safe(job, tmp, &finished, link) {
+		wl_list_remove(&job->link);
+		if (job->done) {
+			job->done(job->data);
+		}
+		free(job);
+	}
+}
+
+static bool set_nonblock(int fd) {
+	int flags = fcntl(fd, F_GETFL);
+	return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+struct worker_pool *worker_pool_create(struct loop *loop, int threads) {
+	struct worker_pool *pool = calloc(1, sizeof(struct worker_pool));
+	if (!pool) {
+		swaylock_log(LOG_ERROR, "Unable to allocate memory for worker pool");
+		return NULL;
+	}
+	wl_list_init(&pool->pending);
+	wl_list_init(&pool->finished);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	if (pipe(pool->notify_fds) != 0) {
+		swaylock_log_errno(LOG_ERROR, "Failed to create worker pipe");
+		goto error;
+	}
+	if (!set_nonblock(pool->notify_fds[0]) ||
+			!set_nonblock(pool->notify_fds[1])) {
+		swaylock_log_errno(LOG_ERROR, "Failed to make worker pipe nonblocking");
+		goto error_pipe;
+	}
+
+	int started = 0;
+	for (int i = 0; i < threads; ++i) {
+		pthread_t thread;
+		int ret = pthread_create(&thread, NULL, worker_thread, pool);
+		if (ret != 0) {
+			errno = ret;
+			swaylock_log_errno(LOG_ERROR, "Failed to start worker thread");
+			continue;
+		}
+		pthread_detach(thread);
+		++started;
+	}
+	if (started == 0) {
+		goto error_pipe;
+	}
+
+	loop_add_fd(loop, pool->notify_fds[0], POLLIN, handle_finished, pool);
+	return pool;
+
+error_pipe:
+	close(pool->notify_fds[0]);
+	close(pool->notify_fds[1]);
+error:
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+	return NULL;
+}
+
+bool worker_pool_submit(struct worker_pool *pool, void (*work)(void *data),
+		void (*done)(void *data), void *data) {
+	struct worker_job *job = calloc(1, sizeof(struct worker_job));
+	if (!job) {
+		swaylock_log(LOG_ERROR, "Unable to allocate memory for job");
+		return false;
+	}
+	job->work = work;
+	job->done = done;
+	job->data = data;
+
+	pthread_mutex_lock(&pool->lock);
+	wl_list_insert(&pool->pending, &job->link);
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	return true;
+}
+
+int worker_pool_default_size(void) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) {
+		return 1;
+	}
+	return cpus < MAX_DEFAULT_THREADS ? cpus : MAX_DEFAULT_THREADS;
+}